@@ -0,0 +1,260 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "emu/kinnow_convert.hpp"
+#include "emu/kinnowfb.hpp"
+#include "emu/spsc_queue.hpp"
+#include "emu/triple_buffer.hpp"
+
+struct KeyEvent {
+  int code;
+  bool pressed;
+};
+
+// Keys pressed in the window, on their way from the display thread to the emulation thread.
+using KeyQueue = SpscQueue<KeyEvent, 256>;
+
+// A copy of VRAM and what changed in it since the previous snapshot.
+struct FrameSnapshot {
+  std::vector<uint16_t> vram;
+  std::vector<FbRect> damage;
+};
+
+// Carries framebuffer snapshots from the emulation thread to the display thread. The emulation
+// thread never waits: if the display falls behind, it just sees the newest snapshot.
+class FrameHandoff {
+public:
+  // Called by the emulation thread once per frame.
+  void publish(KinnowFb &kinnow) {
+    auto &damage = kinnow.damage();
+    if (damage.empty())
+      return;
+
+    auto &frame = m_frames.back();
+    auto vram = kinnow.vram();
+
+    frame.vram.assign(vram, vram + kinnow.width() * kinnow.height());
+    frame.damage.assign(damage.begin(), damage.end());
+
+    // The snapshot this one may replace hasn't been shown yet, so its damage comes along. If the
+    // display takes it in the meantime, that area is just uploaded twice.
+    if (m_frames.pending())
+      frame.damage.insert(frame.damage.end(), m_unseen.begin(), m_unseen.end());
+
+    // A display that stays behind would otherwise make the list grow without end.
+    if (frame.damage.size() > (size_t)kinnow.height())
+      frame.damage.assign(1, {0, 0, kinnow.width(), kinnow.height()});
+
+    m_unseen = frame.damage;
+    m_frames.publish();
+  }
+
+  // Called by the display thread; nullptr if nothing changed since last time.
+  const FrameSnapshot *acquire() {
+    return m_frames.acquire();
+  }
+
+private:
+  TripleBuffer<FrameSnapshot> m_frames;
+  std::vector<FbRect> m_unseen; // Damage of the last snapshot published
+};
+
+// The SDL window the framebuffer is shown in, and where keyboard input comes from. It lives on
+// the main thread (SDL wants that) while the emulator runs on another, and only ever sees
+// snapshots of the framebuffer. Headless builds leave this out entirely, so they don't link
+// against SDL.
+class Display {
+  // Maps SDL scancodes onto Amanatsu key codes; copied from https://github.com/limnarch/limnemu/blob/main/src/keybd.c
+  constexpr static int key_map[SDL_NUM_SCANCODES] = {
+      [SDL_SCANCODE_A] = 0x01,
+      [SDL_SCANCODE_B] = 0x02,
+      [SDL_SCANCODE_C] = 0x03,
+      [SDL_SCANCODE_D] = 0x04,
+      [SDL_SCANCODE_E] = 0x05,
+      [SDL_SCANCODE_F] = 0x06,
+      [SDL_SCANCODE_G] = 0x07,
+      [SDL_SCANCODE_H] = 0x08,
+      [SDL_SCANCODE_I] = 0x09,
+      [SDL_SCANCODE_J] = 0x0A,
+      [SDL_SCANCODE_K] = 0x0B,
+      [SDL_SCANCODE_L] = 0x0C,
+      [SDL_SCANCODE_M] = 0x0D,
+      [SDL_SCANCODE_N] = 0x0E,
+      [SDL_SCANCODE_O] = 0x0F,
+      [SDL_SCANCODE_P] = 0x10,
+      [SDL_SCANCODE_Q] = 0x11,
+      [SDL_SCANCODE_R] = 0x12,
+      [SDL_SCANCODE_S] = 0x13,
+      [SDL_SCANCODE_T] = 0x14,
+      [SDL_SCANCODE_U] = 0x15,
+      [SDL_SCANCODE_V] = 0x16,
+      [SDL_SCANCODE_W] = 0x17,
+      [SDL_SCANCODE_X] = 0x18,
+      [SDL_SCANCODE_Y] = 0x19,
+      [SDL_SCANCODE_Z] = 0x1A,
+      [SDL_SCANCODE_0] = 0x1B,
+      [SDL_SCANCODE_1] = 0x1C,
+      [SDL_SCANCODE_2] = 0x1D,
+      [SDL_SCANCODE_3] = 0x1E,
+      [SDL_SCANCODE_4] = 0x1F,
+      [SDL_SCANCODE_5] = 0x20,
+      [SDL_SCANCODE_6] = 0x21,
+      [SDL_SCANCODE_7] = 0x22,
+      [SDL_SCANCODE_8] = 0x23,
+      [SDL_SCANCODE_9] = 0x24,
+      [SDL_SCANCODE_SEMICOLON] = 0x25,
+      [SDL_SCANCODE_SPACE] = 0x26,
+      [SDL_SCANCODE_TAB] = 0x27,
+      [SDL_SCANCODE_MINUS] = 0x28,
+      [SDL_SCANCODE_EQUALS] = 0x29,
+      [SDL_SCANCODE_LEFTBRACKET] = 0x2A,
+      [SDL_SCANCODE_RIGHTBRACKET] = 0x2B,
+      [SDL_SCANCODE_BACKSLASH] = 0x2C,
+      [SDL_SCANCODE_NONUSHASH] = 0x2C,
+      [SDL_SCANCODE_SLASH] = 0x2E,
+      [SDL_SCANCODE_PERIOD] = 0x2F,
+      [SDL_SCANCODE_APOSTROPHE] = 0x30,
+      [SDL_SCANCODE_COMMA] = 0x31,
+      [SDL_SCANCODE_GRAVE] = 0x32,
+      [SDL_SCANCODE_RETURN] = 0x33,
+      [SDL_SCANCODE_BACKSPACE] = 0x34,
+      [SDL_SCANCODE_CAPSLOCK] = 0x35,
+      [SDL_SCANCODE_ESCAPE] = 0x36,
+      [SDL_SCANCODE_LEFT] = 0x37,
+      [SDL_SCANCODE_RIGHT] = 0x38,
+      [SDL_SCANCODE_DOWN] = 0x39,
+      [SDL_SCANCODE_UP] = 0x3A,
+      [SDL_SCANCODE_LCTRL] = 0x51,
+      [SDL_SCANCODE_RCTRL] = 0x52,
+      [SDL_SCANCODE_LSHIFT] = 0x53,
+      [SDL_SCANCODE_RSHIFT] = 0x54,
+      [SDL_SCANCODE_LALT] = 0x55,
+      [SDL_SCANCODE_RALT] = 0x56,
+      [SDL_SCANCODE_KP_DIVIDE] = 0x2E,
+      [SDL_SCANCODE_KP_MINUS] = 0x28,
+      [SDL_SCANCODE_KP_ENTER] = 0x33,
+      [SDL_SCANCODE_KP_0] = 0x1B,
+      [SDL_SCANCODE_KP_1] = 0x1C,
+      [SDL_SCANCODE_KP_2] = 0x1D,
+      [SDL_SCANCODE_KP_3] = 0x1E,
+      [SDL_SCANCODE_KP_4] = 0x1F,
+      [SDL_SCANCODE_KP_5] = 0x20,
+      [SDL_SCANCODE_KP_6] = 0x21,
+      [SDL_SCANCODE_KP_7] = 0x22,
+      [SDL_SCANCODE_KP_8] = 0x23,
+      [SDL_SCANCODE_KP_9] = 0x24,
+      [SDL_SCANCODE_KP_PERIOD] = 0x2F,
+  };
+
+public:
+  // With `native_pixels` the texture takes Kinnow's 5:5:5 pixels as they are, so VRAM is uploaded
+  // directly at half the bandwidth and never converted. The GPU widens the channels itself, which
+  // may round the odd colour slightly differently from the ARGB8888 path.
+  Display(int width, int height, bool native_pixels) : m_width(width), m_native_pixels(native_pixels) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+      throw std::runtime_error(std::string("Unable to initialize SDL: ") + SDL_GetError());
+
+    m_window = SDL_CreateWindow("ls-emu", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0);
+    if (!m_window)
+      throw std::runtime_error(std::string("Failed to create window: ") + SDL_GetError());
+
+    m_renderer = SDL_CreateRenderer(m_window, -1, 0);
+    if (!m_renderer)
+      throw std::runtime_error(std::string("Could not create renderer: ") + SDL_GetError());
+
+    // Kinnow keeps red in the low bits, which is SDL's BGR555 rather than RGB555.
+    auto format = native_pixels ? SDL_PIXELFORMAT_BGR555 : SDL_PIXELFORMAT_ARGB8888;
+
+    m_texture = SDL_CreateTexture(m_renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!m_texture)
+      throw std::runtime_error(std::string("Could not create texture: ") + SDL_GetError());
+
+    if (!native_pixels)
+      m_pixels.resize(width * height);
+
+    SDL_ShowWindow(m_window);
+    SDL_RenderClear(m_renderer);
+    SDL_RenderCopy(m_renderer, m_texture, nullptr, nullptr);
+  }
+
+  ~Display() {
+    SDL_DestroyTexture(m_texture);
+    SDL_DestroyRenderer(m_renderer);
+    SDL_DestroyWindow(m_window);
+    SDL_Quit();
+  }
+
+  Display(const Display &) = delete;
+  Display &operator=(const Display &) = delete;
+
+  // Queues up pending key events for the emulator. Returns false once the window has been closed.
+  bool poll_events(KeyQueue &keys) {
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event)) {
+      switch (event.type) {
+      case SDL_QUIT: // Handle native app exit
+        return false;
+      case SDL_KEYDOWN:
+      case SDL_KEYUP:
+        keys.push({key_map[event.key.keysym.scancode], event.type == SDL_KEYDOWN});
+        break;
+      case SDL_WINDOWEVENT: // The window may need repainting even if the guest drew nothing
+        m_repaint = true;
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  // Uploads the damaged parts of a new snapshot, if there is one, and presents it. Without either
+  // a snapshot or a repaint request there's nothing to do.
+  void present(const FrameSnapshot *frame) {
+    if (!frame && !m_repaint)
+      return;
+
+    if (frame)
+      upload(*frame);
+
+    SDL_RenderCopy(m_renderer, m_texture, nullptr, nullptr);
+    SDL_RenderPresent(m_renderer);
+
+    m_repaint = false;
+  }
+
+private:
+  void upload(const FrameSnapshot &frame) {
+    for (auto &rect : frame.damage) {
+      SDL_Rect area = {rect.x, rect.y, rect.width, rect.height};
+      auto offset = rect.y * m_width + rect.x;
+
+      if (m_native_pixels) {
+        SDL_UpdateTexture(m_texture, &area, frame.vram.data() + offset, m_width * 2);
+        continue;
+      }
+
+      for (int y = 0; y < rect.height; y++)
+        m_convert(m_pixels.data() + offset + y * m_width, frame.vram.data() + offset + y * m_width, rect.width);
+
+      SDL_UpdateTexture(m_texture, &area, m_pixels.data() + offset, m_width * 4);
+    }
+  }
+
+  SDL_Window *m_window = nullptr;
+  SDL_Renderer *m_renderer = nullptr;
+  SDL_Texture *m_texture = nullptr;
+
+  int m_width;
+  bool m_native_pixels;
+  bool m_repaint = true;
+
+  // ARGB8888 conversion of the snapshots, unless the texture takes them as they are.
+  std::vector<uint32_t> m_pixels;
+  KinnowConvert m_convert = kinnow_select_convert();
+};
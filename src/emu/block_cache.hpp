@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Cpu;
+
+struct DecodedInstruction {
+  using Handler = bool (Cpu::*)(const DecodedInstruction &);
+
+  Handler handler;
+
+  uint32_t imm;
+
+  uint8_t op;
+  uint8_t reg_d;
+  uint8_t reg_a;
+  uint8_t reg_b;
+  uint8_t shift_type;
+  uint8_t shift_count;
+
+  bool ends_block;
+};
+
+// Host code for a whole block: runs from `pc` until the end of the block or the first instruction
+// that needs the interpreter to stop, leaves the following PC in `*next_pc` and returns the number
+// of instructions it retired.
+using CompiledBlock = uint32_t (*)(Cpu *cpu, uint32_t *regs, uint32_t pc, uint32_t *next_pc);
+
+// A straight-line run of instructions, ending with the first branch, jump or
+// privileged operation, or at the end of the physical page it was decoded from.
+struct DecodedBlock {
+  std::vector<DecodedInstruction> instructions;
+
+  uint32_t executions = 0;
+  CompiledBlock compiled = nullptr;
+};
+
+// Predecoded blocks keyed by the physical address of their first instruction. Blocks never
+// cross a page boundary, so a write anywhere in a page only has to drop that page's blocks.
+class BlockCache {
+public:
+  constexpr static uint32_t page_size = 4096;
+  constexpr static uint32_t page_count = 0x100000000 / page_size;
+
+private:
+  struct CodePage {
+    std::unique_ptr<DecodedBlock> blocks[page_size / 4];
+  };
+
+public:
+  BlockCache() : m_code_pages(page_count / 64, 0) {
+  }
+
+  DecodedBlock *lookup(uint32_t phys) {
+    auto page = find_page(phys / page_size);
+    if (!page)
+      return nullptr;
+
+    return page->blocks[(phys % page_size) / 4].get();
+  }
+
+  DecodedBlock *insert(uint32_t phys, std::unique_ptr<DecodedBlock> block) {
+    auto page_num = phys / page_size;
+    auto &page = m_pages[page_num];
+
+    if (!page)
+      page = std::make_unique<CodePage>();
+
+    m_code_pages[page_num / 64] |= 1ull << (page_num % 64);
+    m_last_page_num = page_num;
+    m_last_page = page.get();
+    m_retired.clear();
+
+    return (page->blocks[(phys % page_size) / 4] = std::move(block)).get();
+  }
+
+  // Called for every write to cacheable memory, so the common case (no code in
+  // the page) has to stay a single bit test.
+  void invalidate(uint32_t phys) {
+    auto page_num = phys / page_size;
+
+    if (m_code_pages[page_num / 64] & (1ull << (page_num % 64)))
+      invalidate_page(page_num);
+  }
+
+  void flush() {
+    for (auto &[page_num, page] : m_pages)
+      m_retired.push_back(std::move(page));
+
+    m_pages.clear();
+    std::fill(m_code_pages.begin(), m_code_pages.end(), 0);
+
+    m_last_page = nullptr;
+    m_generation++;
+  }
+
+  // Bumped whenever blocks are dropped; holders of a `DecodedBlock *` must re-lookup after a change.
+  uint64_t generation() const {
+    return m_generation;
+  }
+
+private:
+  CodePage *find_page(uint32_t page_num) {
+    if (m_last_page && m_last_page_num == page_num)
+      return m_last_page;
+
+    auto it = m_pages.find(page_num);
+    if (it == m_pages.end())
+      return nullptr;
+
+    m_last_page_num = page_num;
+    m_last_page = it->second.get();
+
+    return m_last_page;
+  }
+
+  // The CPU may still be in the middle of an instruction from this page (a store hitting its own
+  // code), so the page is only freed on the next insertion.
+  void invalidate_page(uint32_t page_num) {
+    if (auto it = m_pages.find(page_num); it != m_pages.end()) {
+      m_retired.push_back(std::move(it->second));
+      m_pages.erase(it);
+    }
+
+    m_code_pages[page_num / 64] &= ~(1ull << (page_num % 64));
+
+    if (m_last_page_num == page_num)
+      m_last_page = nullptr;
+
+    m_generation++;
+  }
+
+  std::unordered_map<uint32_t, std::unique_ptr<CodePage>> m_pages;
+  std::vector<std::unique_ptr<CodePage>> m_retired;
+  std::vector<uint64_t> m_code_pages;
+
+  CodePage *m_last_page = nullptr;
+  uint32_t m_last_page_num = 0;
+
+  uint64_t m_generation = 0;
+};
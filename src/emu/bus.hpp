@@ -1,15 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 
+#include "block_cache.hpp"
+
 enum BusSize : uint8_t {
   BUS_BYTE,
   BUS_INT,
   BUS_LONG,
 };
 
+inline uint32_t bus_width(BusSize size) {
+  return 1u << size;
+}
+
 class Area : public std::enable_shared_from_this<Area> {
 public:
   constexpr static uint32_t area_size = 128 * 1024 * 1024;
@@ -24,26 +32,73 @@ public:
   virtual bool mem_write(uint32_t addr, BusSize size, uint32_t value) {
     return false;
   }
+
+  // Areas answering true here must report writes to those addresses to the bus' code cache.
+  virtual bool can_cache_code(uint32_t addr) {
+    return false;
+  }
 };
 
 class Bus {
+  struct HostPage {
+    uint8_t *read = nullptr;
+    uint8_t *write = nullptr;
+  };
+
+  // Non-owning view of `m_areas` used on every access, so the hot path never touches a refcount.
+  struct AreaDispatch {
+    Area *area = nullptr;
+
+    bool (*read[3])(Area *area, uint32_t addr, uint32_t &value) = {};
+    bool (*write[3])(Area *area, uint32_t addr, uint32_t value) = {};
+  };
+
 public:
   constexpr static uint32_t areas = 0x100000000 / Area::area_size;
   constexpr static uint32_t slot_start = 24;
+  constexpr static uint32_t page_size = 4096;
+  constexpr static uint32_t pages_per_area = Area::area_size / page_size;
 
-  void map(uint32_t num, std::shared_ptr<Area> area) {
+  // The accessors are instantiated for the static type of `area`, so mapping a final class
+  // lets the compiler devirtualize (and usually inline) its `mem_read`/`mem_write`.
+  template <typename T>
+  void map(uint32_t num, std::shared_ptr<T> area) {
     if (m_areas[num] != nullptr)
       throw std::runtime_error("Area already mapped");
 
     m_areas[num] = area;
+    m_dispatch[num] = {
+        area.get(),
+        {&dispatch_read<T, BUS_BYTE>, &dispatch_read<T, BUS_INT>, &dispatch_read<T, BUS_LONG>},
+        {&dispatch_write<T, BUS_BYTE>, &dispatch_write<T, BUS_INT>, &dispatch_write<T, BUS_LONG>},
+    };
   }
 
   void unmap(uint32_t num) {
     m_areas[num] = nullptr;
+    m_dispatch[num] = {};
+    m_host_pages[num] = nullptr;
+  }
+
+  // Lets plain memory inside an already mapped area be accessed straight through `memory`,
+  // skipping the area entirely. Only whole pages are mapped; a partial tail page keeps going
+  // through the area so its bounds checks still apply.
+  void map_host(uint32_t addr, uint32_t size, uint8_t *memory, bool writable) {
+    for (uint32_t offset = 0; offset + page_size <= size; offset += page_size) {
+      auto page_addr = addr + offset;
+      auto &table = m_host_pages[page_addr >> 27];
+
+      if (!table)
+        table = std::make_unique<HostPage[]>(pages_per_area);
+
+      auto &page = table[(page_addr & 0x7ffffff) / page_size];
+      page.read = memory + offset;
+      page.write = writable ? memory + offset : nullptr;
+    }
   }
 
   void reset() {
-    for (auto area : m_areas) {
+    for (auto &area : m_areas) {
       if (area)
         area->reset();
     }
@@ -52,8 +107,20 @@ public:
   bool mem_read(uint32_t addr, BusSize size, uint32_t &value) {
     auto area_num = addr >> 27;
 
-    if (auto area = m_areas[area_num]) {
-      return area->mem_read(addr & 0x7ffffff, size, value);
+    if (auto page = host_page(addr, size); page && page->read) {
+      auto memory = page->read + addr % page_size;
+      if (size == BUS_BYTE)
+        value = *(uint8_t *)memory;
+      else if (size == BUS_INT)
+        value = *(uint16_t *)memory;
+      else if (size == BUS_LONG)
+        value = *(uint32_t *)memory;
+
+      return true;
+    }
+
+    if (auto &dispatch = m_dispatch[area_num]; dispatch.area) {
+      return dispatch.read[size](dispatch.area, addr & 0x7ffffff, value);
     } else if (area_num >= slot_start) {
       value = 0;
       return true;
@@ -65,12 +132,115 @@ public:
   bool mem_write(uint32_t addr, BusSize size, uint32_t value) {
     auto area_num = addr >> 27;
 
-    if (auto area = m_areas[area_num])
-      return area->mem_write(addr & 0x7ffffff, size, value);
+    if (auto page = host_page(addr, size); page && page->write) {
+      auto memory = page->write + addr % page_size;
+      if (size == BUS_BYTE)
+        *(uint8_t *)memory = value;
+      else if (size == BUS_INT)
+        *(uint16_t *)memory = value;
+      else if (size == BUS_LONG)
+        *(uint32_t *)memory = value;
+
+      m_code_cache.invalidate(addr);
+      return true;
+    }
+
+    if (auto &dispatch = m_dispatch[area_num]; dispatch.area)
+      return dispatch.write[size](dispatch.area, addr & 0x7ffffff, value);
     else
       return false;
   }
 
+  // Whether every page of [addr, addr + size) is plain host memory, as devices only DMA to RAM.
+  bool host_mapped(uint32_t addr, uint32_t size, bool writable) {
+    if ((uint64_t)addr + size > 0x100000000)
+      return false;
+
+    for (uint64_t page_addr = addr & ~(page_size - 1); page_addr < (uint64_t)addr + size; page_addr += page_size) {
+      auto &table = m_host_pages[page_addr >> 27];
+      if (!table)
+        return false;
+
+      auto &page = table[(page_addr & 0x7ffffff) / page_size];
+      if (!(writable ? page.write : page.read))
+        return false;
+    }
+
+    return true;
+  }
+
+  // Bulk copies for DMA, a page at a time since neighbouring pages needn't be neighbours on the
+  // host. Nothing is copied unless the whole range is host memory.
+  bool dma_read(uint32_t addr, uint8_t *data, uint32_t size) {
+    if (!host_mapped(addr, size, false))
+      return false;
+
+    while (size) {
+      auto chunk = std::min(size, page_size - addr % page_size);
+      memcpy(data, m_host_pages[addr >> 27][(addr & 0x7ffffff) / page_size].read + addr % page_size, chunk);
+
+      addr += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+
+    return true;
+  }
+
+  bool dma_write(uint32_t addr, const uint8_t *data, uint32_t size) {
+    if (!host_mapped(addr, size, true))
+      return false;
+
+    while (size) {
+      auto chunk = std::min(size, page_size - addr % page_size);
+      memcpy(m_host_pages[addr >> 27][(addr & 0x7ffffff) / page_size].write + addr % page_size, data, chunk);
+
+      // Invalidation is per page, so once per page covers every word written.
+      m_code_cache.invalidate(addr);
+
+      addr += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+
+    return true;
+  }
+
+  bool can_cache_code(uint32_t addr) {
+    if (auto area = m_dispatch[addr >> 27].area)
+      return area->can_cache_code(addr & 0x7ffffff);
+
+    return false;
+  }
+
+  BlockCache &code_cache() {
+    return m_code_cache;
+  }
+
 private:
+  template <typename T, BusSize size>
+  static bool dispatch_read(Area *area, uint32_t addr, uint32_t &value) {
+    return static_cast<T *>(area)->mem_read(addr, size, value);
+  }
+
+  template <typename T, BusSize size>
+  static bool dispatch_write(Area *area, uint32_t addr, uint32_t value) {
+    return static_cast<T *>(area)->mem_write(addr, size, value);
+  }
+
+  // Accesses straddling a page boundary take the slow path, as the next page may not be contiguous.
+  HostPage *host_page(uint32_t addr, BusSize size) {
+    auto &table = m_host_pages[addr >> 27];
+    if (!table || addr % page_size + bus_width(size) > page_size)
+      return nullptr;
+
+    return &table[(addr & 0x7ffffff) / page_size];
+  }
+
+  BlockCache m_code_cache;
+
+  std::unique_ptr<HostPage[]> m_host_pages[areas];
+
   std::shared_ptr<Area> m_areas[areas] = {nullptr};
+  AreaDispatch m_dispatch[areas];
 };
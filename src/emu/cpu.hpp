@@ -1,10 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 
 #include "bus.hpp"
+#include "jit.hpp"
 #include "lsic.hpp"
-#include "platform.hpp"
+#include "tlb.hpp"
 
 inline uint32_t sign_ext(uint32_t value, uint32_t bits) {
   return (int32_t)(value << bits) >> bits;
@@ -37,6 +40,10 @@ inline uint32_t less_than(uint32_t lhs, uint32_t rhs, bool is_signed) {
     return lhs < rhs ? 1 : 0;
 }
 
+constexpr uint32_t bus_mask(BusSize size) {
+  return size == BUS_BYTE ? 0xff : size == BUS_INT ? 0xffff : 0xffffffff;
+}
+
 inline uint32_t shift(uint32_t lhs, uint32_t rhs, uint32_t shift_type) {
   switch (shift_type) {
   case 0b00: return lhs << rhs;             // Shift Left
@@ -71,6 +78,24 @@ enum ControlRegisters : uint32_t {
   CTL_FWVEC = 9,
 };
 
+enum MemoryAccess : uint8_t {
+  ACCESS_FETCH,
+  ACCESS_READ,
+  ACCESS_WRITE,
+};
+
+enum StopReason : uint8_t {
+  STOP_BUDGET,
+  STOP_HALTED,
+  STOP_DEADLINE,
+  STOP_REQUESTED,
+};
+
+struct RunResult {
+  uint64_t retired;
+  StopReason reason;
+};
+
 enum ExceptionType : uint32_t {
   EXC_INTERRUPT = 1,
   EXC_SYSCALL = 2,
@@ -90,9 +115,75 @@ static const char *exception_names[] = {
     [EXC_PAGEFAULT] = "EXC_PAGEFAULT", [EXC_PAGEWRITE] = "EXC_PAGEWRITE",
 };
 
+// Every operation the decoder can produce, paired with the handler that implements it. The
+// handler table and the threaded interpreter's jump table are both generated from this list.
+#define CPU_OPCODES(X)                                                                                                                               \
+  X(OP_NOP, op_nop)                                                                                                                                  \
+  X(OP_INVALID, op_invalid)                                                                                                                          \
+  X(OP_INVALID_PRIVILEGED, op_invalid_privileged)                                                                                                    \
+  X(OP_JAL, op_jal)                                                                                                                                  \
+  X(OP_J, op_j)                                                                                                                                      \
+  X(OP_NOR, op_nor)                                                                                                                                  \
+  X(OP_OR, op_or)                                                                                                                                    \
+  X(OP_XOR, op_xor)                                                                                                                                  \
+  X(OP_AND, op_and)                                                                                                                                  \
+  X(OP_SLT_SIGNED, op_slt_signed)                                                                                                                    \
+  X(OP_SLT, op_slt)                                                                                                                                  \
+  X(OP_SUB, op_sub)                                                                                                                                  \
+  X(OP_ADD, op_add)                                                                                                                                  \
+  X(OP_SHIFT, op_shift)                                                                                                                              \
+  X(OP_STORE_REG_LONG, op_store_reg<BUS_LONG>)                                                                                                       \
+  X(OP_STORE_REG_INT, op_store_reg<BUS_INT>)                                                                                                         \
+  X(OP_STORE_REG_BYTE, op_store_reg<BUS_BYTE>)                                                                                                       \
+  X(OP_LOAD_REG_LONG, op_load_reg<BUS_LONG>)                                                                                                         \
+  X(OP_LOAD_REG_INT, op_load_reg<BUS_INT>)                                                                                                           \
+  X(OP_LOAD_REG_BYTE, op_load_reg<BUS_BYTE>)                                                                                                         \
+  X(OP_SYS, op_sys)                                                                                                                                  \
+  X(OP_BRK, op_brk)                                                                                                                                  \
+  X(OP_SC, op_sc)                                                                                                                                    \
+  X(OP_LL, op_ll)                                                                                                                                    \
+  X(OP_MOD, op_mod)                                                                                                                                  \
+  X(OP_DIV_SIGNED, op_div_signed)                                                                                                                    \
+  X(OP_DIV, op_div)                                                                                                                                  \
+  X(OP_MUL, op_mul)                                                                                                                                  \
+  X(OP_FWC, op_fwc)                                                                                                                                  \
+  X(OP_RFE, op_rfe)                                                                                                                                  \
+  X(OP_HLT, op_hlt)                                                                                                                                  \
+  X(OP_FTLB, op_ftlb)                                                                                                                                \
+  X(OP_MTCR, op_mtcr)                                                                                                                                \
+  X(OP_MFCR, op_mfcr)                                                                                                                                \
+  X(OP_BEQ, op_beq)                                                                                                                                  \
+  X(OP_BNE, op_bne)                                                                                                                                  \
+  X(OP_BLT, op_blt)                                                                                                                                  \
+  X(OP_JALR, op_jalr)                                                                                                                                \
+  X(OP_ADDI, op_addi)                                                                                                                                \
+  X(OP_SUBI, op_subi)                                                                                                                                \
+  X(OP_SLTI, op_slti)                                                                                                                                \
+  X(OP_SLTI_SIGNED, op_slti_signed)                                                                                                                  \
+  X(OP_ANDI, op_andi)                                                                                                                                \
+  X(OP_XORI, op_xori)                                                                                                                                \
+  X(OP_ORI, op_ori)                                                                                                                                  \
+  X(OP_LOAD_IMM_BYTE, op_load_imm<BUS_BYTE>)                                                                                                         \
+  X(OP_LOAD_IMM_INT, op_load_imm<BUS_INT>)                                                                                                           \
+  X(OP_LOAD_IMM_LONG, op_load_imm<BUS_LONG>)                                                                                                         \
+  X(OP_STORE_IMM_BYTE, op_store_imm<BUS_BYTE>)                                                                                                       \
+  X(OP_STORE_IMM_INT, op_store_imm<BUS_INT>)                                                                                                         \
+  X(OP_STORE_IMM_LONG, op_store_imm<BUS_LONG>)                                                                                                       \
+  X(OP_STORE_IMM5_BYTE, op_store_imm5<BUS_BYTE>)                                                                                                     \
+  X(OP_STORE_IMM5_INT, op_store_imm5<BUS_INT>)                                                                                                       \
+  X(OP_STORE_IMM5_LONG, op_store_imm5<BUS_LONG>)
+
+enum CpuOp : uint8_t {
+#define X(name, handler) name,
+  CPU_OPCODES(X)
+#undef X
+};
+
 class Cpu {
 public:
-  Cpu(Bus &bus, InterruptController &int_ctl) : m_bus(bus), m_int_ctl(int_ctl) {
+  constexpr static uint32_t jit_threshold = 32;
+
+  Cpu(Bus &bus, InterruptController &int_ctl) : m_bus(bus), m_int_ctl(int_ctl), m_code_cache(bus.code_cache()) {
     reset();
   }
 
@@ -102,22 +193,110 @@ public:
     m_ctl_regs[CTL_EVEC] = 0;
     m_ctl_regs[CTL_CPUID] = 0x80060000;
     m_exc = 0;
+    m_block = nullptr;
+    m_itlb.flush();
+    m_dtlb.flush();
   }
 
   bool is_halted() const {
     return m_halt;
   }
 
+  uint64_t instructions_retired() const {
+    return m_retired;
+  }
+
+  const TlbStats &itlb_stats() const {
+    return m_itlb.stats();
+  }
+
+  const TlbStats &dtlb_stats() const {
+    return m_dtlb.stats();
+  }
+
+  // Translates blocks to host code once they've run `jit_threshold` times. Returns false when the
+  // host isn't supported, in which case everything keeps going through the interpreter.
+  bool enable_jit() {
+#ifdef LS_EMU_HAS_JIT
+    if (!m_jit_arena)
+      m_jit_arena = std::make_unique<JitArena>();
+
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Picks between the threaded interpreter (the default) and stepping through `execute` one
+  // instruction at a time, which is kept around to compare against.
+  void set_threaded(bool threaded) {
+    m_threaded = threaded;
+  }
+
+  // Runs until `max_instructions` have retired, the CPU halts, the deadline set with `set_deadline`
+  // is reached or `request_stop` is called. Exceptions and interrupts are taken along the way.
+  RunResult run(uint64_t max_instructions) {
+    auto start = m_retired;
+
+    m_run_end = start + std::min(max_instructions, m_deadline > start ? m_deadline - start : 0);
+
+    if (m_threaded)
+      run_threaded();
+    else
+      run_stepping();
+
+    return {m_retired - start, stop_reason()};
+  }
+
+  // Makes `run` return once the retired count reaches `retired`, e.g. when a device is next due.
+  // May be called by a device from inside `run`, in which case it takes effect immediately.
+  void set_deadline(uint64_t retired) {
+    m_deadline = retired;
+    m_run_end = std::min(m_run_end, std::max(retired, m_retired));
+  }
+
+  void clear_deadline() {
+    m_deadline = UINT64_MAX;
+  }
+
+  // Safe to call from another thread; `run` notices it at the next block boundary.
+  void request_stop() {
+    m_stop_requested.store(true, std::memory_order_relaxed);
+  }
+
   bool execute() {
+    if (!enter_pending())
+      return true;
+
+    auto current_pc = m_pc;
+
+    m_pc += 4;
+
+    auto insn = fetch(current_pc);
+    if (m_compiled)
+      return execute_compiled(current_pc);
+
+    // A fetch that faulted retires nothing; the handler is what runs next.
+    if (!insn)
+      return false;
+
+    m_retired++;
+    return (this->*insn->handler)(*insn);
+  }
+
+private:
+  // Leaves a halt and enters the exception or interrupt handler if one is due. Returns false
+  // while the CPU stays halted.
+  bool enter_pending() {
     if (m_halt) {
-      if (m_exc || (m_ctl_regs[CTL_RS] & RS_INT && m_int_ctl.interrupt_pending())) {
+      if (exception_pending()) {
         m_halt = false;
       } else {
-        return true;
+        return false;
       }
     }
 
-    if (m_exc || (m_ctl_regs[CTL_RS] & RS_INT && m_int_ctl.interrupt_pending())) {
+    if (exception_pending()) {
       auto exc_vector = 0;
       auto new_state = m_ctl_regs[CTL_RS] & 0xfffffffc;
 
@@ -145,41 +324,108 @@ public:
       }
 
       m_exc = 0;
+      m_block = nullptr;
     }
 
-    auto instruction = 0u;
+    return true;
+  }
+
+  // Same as `execute`, but each handler is reached through its own indirect jump and falls
+  // straight through to the next instruction of the block as long as nothing needs the slow
+  // path: no exception or interrupt, and control flow still on the block's straight line.
+  void run_threaded() {
+#ifdef __GNUC__
+#define X(name, handler) &&label_##name,
+    static void *const labels[] = {CPU_OPCODES(X)};
+#undef X
+
+    const DecodedInstruction *insn;
+
+  next:
+    if (m_retired >= m_run_end || m_stop_requested.load(std::memory_order_relaxed))
+      return;
+
+    if (!(insn = begin_step())) {
+      if (m_halt)
+        return;
+
+      goto next;
+    }
+
+    goto *labels[insn->op];
+
+#define X(name, handler)                                                                                                                             \
+  label_##name:                                                                                                                                      \
+    handler(*insn);                                                                                                                                  \
+    if (m_retired >= m_run_end || exception_pending())                                                                                               \
+      goto next;                                                                                                                                     \
+    if (!(insn = next_in_block(m_pc)))                                                                                                               \
+      goto next;                                                                                                                                     \
+    m_pc += 4;                                                                                                                                       \
+    m_retired++;                                                                                                                                     \
+    goto *labels[insn->op];
+
+    CPU_OPCODES(X)
+#undef X
+#else
+    run_stepping();
+#endif
+  }
+
+  void run_stepping() {
+    while (m_retired < m_run_end && !m_stop_requested.load(std::memory_order_relaxed)) {
+      execute();
+
+      if (m_halt)
+        break;
+    }
+  }
+
+  // The part of `execute` leading up to the handler call, for `run_threaded`. Returns null when
+  // there's no handler to dispatch to. Kept out of line: folded into the threaded loop, it costs
+  // more in register pressure than the call saves.
+  [[gnu::noinline]] const DecodedInstruction *begin_step() {
+    if (!enter_pending())
+      return nullptr;
+
     auto current_pc = m_pc;
 
     m_pc += 4;
 
-    if (!mem_read(current_pc, BUS_LONG, instruction))
-      return false;
+    auto insn = fetch(current_pc);
+    if (m_compiled) {
+      execute_compiled(current_pc);
+      return nullptr;
+    }
 
-    auto major = instruction & 0b111;
-    auto major_op = instruction & 0b111111;
+    if (insn)
+      m_retired++;
 
-    if (major == 0b111) { // JAL
-      m_regs[REG_LR] = m_pc;
-      m_pc = (current_pc & 0x80000000) | ((instruction >> 3) << 2);
-      return true;
-    } else if (major == 0b110) { // J
-      m_pc = (current_pc & 0x80000000) | ((instruction >> 3) << 2);
-      return true;
-    } else if (major_op == 0b111001) {
-      return handle_opcode_111001(instruction);
-    } else if (major_op == 0b110001) {
-      return handle_opcode_110001(instruction);
-    } else if (major_op == 0b101001) {
-      return handle_opcode_101001(instruction);
-    } else {
-      return handle_opcode_major(major_op, instruction, current_pc);
-    }
+    return insn;
+  }
 
-    raise_exception(EXC_INVINST);
-    return false;
+  StopReason stop_reason() {
+    if (m_stop_requested.exchange(false, std::memory_order_relaxed))
+      return STOP_REQUESTED;
+
+    if (m_halt)
+      return STOP_HALTED;
+
+    return m_retired >= m_deadline ? STOP_DEADLINE : STOP_BUDGET;
+  }
+
+  bool exception_pending() {
+    return m_exc || (m_ctl_regs[CTL_RS] & RS_INT && m_int_ctl.interrupt_pending());
+  }
+
+  static DecodedInstruction::Handler handler_for(uint8_t op) {
+#define X(name, handler) &Cpu::handler,
+    static const DecodedInstruction::Handler handlers[] = {CPU_OPCODES(X)};
+#undef X
+
+    return handlers[op];
   }
 
-private:
   void raise_exception(uint32_t exception) {
     auto nested = m_exc != 0;
 
@@ -213,54 +459,70 @@ private:
     }
   }
 
-  // TODO: Implement TLB
-  bool translate_va(uint32_t addr, uint32_t &phys, bool is_writing) {
+  // Instruction fetches go through their own TLB so code and data don't evict each other.
+  bool translate_va(uint32_t addr, uint32_t &phys, MemoryAccess access) {
+    auto is_writing = access == ACCESS_WRITE;
     auto virt_page_num = addr >> 12;
     auto virt_page_off = addr & 0xfff;
+    auto &tlb = access == ACCESS_FETCH ? m_itlb : m_dtlb;
 
-    uint32_t pde;
-    uint32_t tlb_high;
+    auto tlb_high = tlb.lookup(virt_page_num, m_ctl_regs[CTL_ASID]);
 
-    if (!m_bus.mem_read(m_ctl_regs[CTL_PGTB] + ((addr >> 22) << 2), BUS_LONG, pde)) {
-      m_ctl_regs[CTL_EBADADDR] = m_ctl_regs[CTL_PGTB] + ((addr >> 22) << 2);
-      raise_exception(EXC_BUSERROR);
-      return false;
+    if (!tlb_high) {
+      if (!walk_page_table(addr, is_writing, tlb_high))
+        return false; // Exception already raised inside `walk_page_table`
+
+      tlb.insert(virt_page_num, m_ctl_regs[CTL_ASID], tlb_high);
     }
 
-    if (!(pde & 0x1)) {
+    if (tlb_high & PTE_KERNEL && m_ctl_regs[CTL_RS] & RS_USER) {
       m_ctl_regs[CTL_EBADADDR] = addr;
       raise_exception(is_writing ? EXC_PAGEWRITE : EXC_PAGEFAULT);
       return false;
     }
 
-    if (!m_bus.mem_read(((pde >> 5) << 12) + ((virt_page_num & 0x3ff) << 2), BUS_LONG, tlb_high)) {
-      m_ctl_regs[CTL_EBADADDR] = ((pde >> 5) << 12) + ((virt_page_num & 0x3ff) << 2);
+    if (is_writing && !(tlb_high & PTE_WRITABLE)) {
+      m_ctl_regs[CTL_EBADADDR] = addr;
+      raise_exception(EXC_PAGEWRITE);
+      return false;
+    }
+
+    auto phys_page_num = ((tlb_high >> 5) & 0xfffff) << 12;
+
+    phys = phys_page_num + virt_page_off;
+
+    return true;
+  }
+
+  bool walk_page_table(uint32_t addr, bool is_writing, uint32_t &tlb_high) {
+    auto virt_page_num = addr >> 12;
+
+    uint32_t pde;
+
+    if (!m_bus.mem_read(m_ctl_regs[CTL_PGTB] + ((addr >> 22) << 2), BUS_LONG, pde)) {
+      m_ctl_regs[CTL_EBADADDR] = m_ctl_regs[CTL_PGTB] + ((addr >> 22) << 2);
       raise_exception(EXC_BUSERROR);
       return false;
     }
 
-    if (!(tlb_high & 0x1)) {
+    if (!(pde & PTE_VALID)) {
       m_ctl_regs[CTL_EBADADDR] = addr;
       raise_exception(is_writing ? EXC_PAGEWRITE : EXC_PAGEFAULT);
       return false;
     }
 
-    if (tlb_high & 0x4 && m_ctl_regs[CTL_RS] & RS_USER) {
-      m_ctl_regs[CTL_EBADADDR] = addr;
-      raise_exception(is_writing ? EXC_PAGEWRITE : EXC_PAGEFAULT);
+    if (!m_bus.mem_read(((pde >> 5) << 12) + ((virt_page_num & 0x3ff) << 2), BUS_LONG, tlb_high)) {
+      m_ctl_regs[CTL_EBADADDR] = ((pde >> 5) << 12) + ((virt_page_num & 0x3ff) << 2);
+      raise_exception(EXC_BUSERROR);
       return false;
     }
 
-    if (is_writing && !(tlb_high & 0x2)) {
+    if (!(tlb_high & PTE_VALID)) {
       m_ctl_regs[CTL_EBADADDR] = addr;
-      raise_exception(EXC_PAGEWRITE);
+      raise_exception(is_writing ? EXC_PAGEWRITE : EXC_PAGEFAULT);
       return false;
     }
 
-    auto phys_page_num = ((tlb_high >> 5) & 0xfffff) << 12;
-
-    phys = phys_page_num + virt_page_off;
-
     return true;
   }
 
@@ -271,7 +533,7 @@ private:
       return false;
     }
 
-    if (m_ctl_regs[CTL_RS] & RS_MMU && !translate_va(addr, addr, false))
+    if (m_ctl_regs[CTL_RS] & RS_MMU && !translate_va(addr, addr, ACCESS_READ))
       return false; // Exception already raised inside `traslate_va`
 
     if (!m_bus.mem_read(addr, size, value)) {
@@ -290,7 +552,7 @@ private:
       return false;
     }
 
-    if (m_ctl_regs[CTL_RS] & RS_MMU && !translate_va(addr, addr, true))
+    if (m_ctl_regs[CTL_RS] & RS_MMU && !translate_va(addr, addr, ACCESS_WRITE))
       return false; // Exception already raised inside `traslate_va`
 
     if (!m_bus.mem_write(addr, size, value)) {
@@ -302,200 +564,808 @@ private:
     return true;
   }
 
-  bool handle_opcode_111001(uint32_t instruction) {
-    auto function = instruction >> 28;
-    auto shift_type = (instruction >> 26) & 0b11;
-    auto shift_count = (instruction >> 21) & 0b11111;
-
-    auto reg_d = (instruction >> 6) & 0b11111;
-    auto reg_a = (instruction >> 11) & 0b11111;
-    auto reg_b = (instruction >> 16) & 0b11111;
-    auto value = shift_count ? shift(m_regs[reg_b], shift_count, shift_type) : m_regs[reg_b];
-
-    if (reg_d || (function >= 9 && function <= 11)) {
-      switch (function) {
-      case 0: m_regs[reg_d] = ~(m_regs[reg_a] | value); return true;                        // NOR
-      case 1: m_regs[reg_d] = m_regs[reg_a] | value; return true;                           // OR
-      case 2: m_regs[reg_d] = m_regs[reg_a] ^ value; return true;                           // XOR
-      case 3: m_regs[reg_d] = m_regs[reg_a] & value; return true;                           // AND
-      case 4: m_regs[reg_d] = less_than(m_regs[reg_a], value, true); return true;           // SLT signed
-      case 5: m_regs[reg_d] = less_than(m_regs[reg_a], value, false); return true;          // SLT
-      case 6: m_regs[reg_d] = m_regs[reg_a] - value; return true;                           // SUB
-      case 7: m_regs[reg_d] = m_regs[reg_a] + value; return true;                           // ADD
-      case 8: m_regs[reg_d] = shift(m_regs[reg_b], m_regs[reg_a], shift_type); return true; // Shift
-      case 9: return mem_write(m_regs[reg_a] + value, BUS_LONG, m_regs[reg_d]);             // Move reg_d to long[reg_a + reg_b]
-      case 10: return mem_write(m_regs[reg_a] + value, BUS_INT, m_regs[reg_d] & 0xffff);    // Move reg_d to int[reg_a + reg_b]
-      case 11: return mem_write(m_regs[reg_a] + value, BUS_BYTE, m_regs[reg_d] & 0xff);     // Move reg_d to byte[reg_a + reg_b]
-      case 13: return mem_read(m_regs[reg_a] + value, BUS_LONG, m_regs[reg_d]);             // Move long[reg_a + reg_b] to reg_d
-      case 14: return mem_read(m_regs[reg_a] + value, BUS_INT, m_regs[reg_d]);              // Move int[reg_a + reg_b] to reg_d
-      case 15: return mem_read(m_regs[reg_a] + value, BUS_BYTE, m_regs[reg_d]);             // Move byte[reg_a + reg_b] to reg_d
+  // Keeps stepping through the current block while execution stays on its straight line, and
+  // only translates the PC and consults the code cache once control flow leaves it.
+  const DecodedInstruction *fetch(uint32_t pc) {
+    if (auto insn = next_in_block(pc))
+      return insn;
+
+    m_block = nullptr;
+
+    if (pc < 0x1000 || pc >= 0xfffff000) {
+      m_ctl_regs[CTL_EBADADDR] = pc;
+      raise_exception(EXC_PAGEFAULT);
+      return nullptr;
+    }
+
+    auto phys = pc;
+
+    if (m_ctl_regs[CTL_RS] & RS_MMU && !translate_va(pc, phys, ACCESS_FETCH))
+      return nullptr; // Exception already raised inside `traslate_va`
+
+    if (!m_bus.can_cache_code(phys)) {
+      uint32_t instruction;
+
+      if (!m_bus.mem_read(phys, BUS_LONG, instruction)) {
+        m_ctl_regs[CTL_EBADADDR] = phys;
+        raise_exception(EXC_BUSERROR);
+        return nullptr;
       }
+
+      m_uncached = decode(instruction);
+      return &m_uncached;
     }
 
-    raise_exception(EXC_INVINST);
-    return false;
+    auto block = m_code_cache.lookup(phys);
+    if (!block && !(block = decode_block(phys)))
+      return nullptr;
+
+    if (m_jit_arena && !block->compiled && ++block->executions == jit_threshold)
+      compile_block(*block);
+
+    // A translated block runs to its end, so it's only entered when that can't overshoot the run.
+    if (block->compiled && m_retired + block->instructions.size() <= m_run_end) {
+      m_compiled = block;
+      return &block->instructions[0];
+    }
+
+    if (block->instructions.size() > 1) {
+      m_block = block;
+      m_block_pc = pc + 4;
+      m_block_index = 1;
+      m_block_generation = m_code_cache.generation();
+    }
+
+    return &block->instructions[0];
   }
 
-  bool handle_opcode_110001(uint32_t instruction) {
-    auto function = instruction >> 28;
+  const DecodedInstruction *next_in_block(uint32_t pc) {
+    if (!m_block || pc != m_block_pc || m_block_generation != m_code_cache.generation())
+      return nullptr;
 
-    auto reg_d = (instruction >> 6) & 0b11111;
-    auto reg_a = (instruction >> 11) & 0b11111;
-    auto reg_b = (instruction >> 16) & 0b11111;
+    auto insn = &m_block->instructions[m_block_index++];
 
-    switch (function) {
-    case 0: // SYS
-      raise_exception(EXC_SYSCALL);
-      return true;
-    case 1: // BRK
-      raise_exception(EXC_BRKPOINT);
-      return true;
-    case 8: // SC
-      if (m_locked && !mem_write(m_regs[reg_a], BUS_LONG, m_regs[reg_b]))
-        return false;
-      if (reg_d != 0)
-        m_regs[reg_d] = m_locked;
-      return true;
-    case 9: // LL
-      m_locked = true;
-      if (reg_d != 0 && !mem_read(m_regs[reg_a], BUS_LONG, m_regs[reg_d]))
-        return false;
-      return true;
-    case 11: // MOD
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_b] ? m_regs[reg_a] % m_regs[reg_b] : 0;
-      return true;
-    case 12: // DIV signed
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_b] ? (int32_t)m_regs[reg_a] / (int32_t)m_regs[reg_b] : 0;
-      return true;
-    case 13: // DIV
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_b] ? m_regs[reg_a] / m_regs[reg_b] : 0;
-      return true;
-    case 15: // MUL
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] * m_regs[reg_b];
-      return true;
+    if (m_block_index == m_block->instructions.size())
+      m_block = nullptr;
+
+    m_block_pc += 4;
+    return insn;
+  }
+
+  DecodedBlock *decode_block(uint32_t phys) {
+    auto block = std::make_unique<DecodedBlock>();
+    auto addr = phys;
+
+    do {
+      uint32_t instruction;
+
+      if (!m_bus.mem_read(addr, BUS_LONG, instruction))
+        break;
+
+      block->instructions.push_back(decode(instruction));
+      addr += 4;
+    } while (!block->instructions.back().ends_block && addr % BlockCache::page_size && m_bus.can_cache_code(addr));
+
+    if (block->instructions.empty()) {
+      m_ctl_regs[CTL_EBADADDR] = phys;
+      raise_exception(EXC_BUSERROR);
+      return nullptr;
     }
 
-    raise_exception(EXC_INVINST);
-    return false;
+    return m_code_cache.insert(phys, std::move(block));
   }
 
-  bool handle_opcode_101001(uint32_t instruction) {
-    if (m_ctl_regs[CTL_RS] & RS_USER) {
-      raise_exception(EXC_INVPRVG);
-      return false;
+  static DecodedInstruction decode(uint32_t instruction) {
+    DecodedInstruction insn = {};
+
+    insn.op = OP_INVALID;
+    insn.reg_d = (instruction >> 6) & 0b11111;
+    insn.reg_a = (instruction >> 11) & 0b11111;
+    insn.reg_b = (instruction >> 16) & 0b11111;
+
+    auto major = instruction & 0b111;
+    auto major_op = instruction & 0b111111;
+
+    if (major == 0b111) { // JAL
+      insn.op = OP_JAL;
+      insn.imm = (instruction >> 3) << 2;
+      insn.ends_block = true;
+    } else if (major == 0b110) { // J
+      insn.op = OP_J;
+      insn.imm = (instruction >> 3) << 2;
+      insn.ends_block = true;
+    } else if (major_op == 0b111001) {
+      decode_opcode_111001(instruction, insn);
+    } else if (major_op == 0b110001) {
+      decode_opcode_110001(instruction, insn);
+    } else if (major_op == 0b101001) {
+      decode_opcode_101001(instruction, insn);
+    } else {
+      decode_opcode_major(major_op, instruction, insn);
     }
 
+    if (insn.op == OP_INVALID)
+      insn.ends_block = true;
+
+    insn.handler = handler_for(insn.op);
+    return insn;
+  }
+
+  static void decode_opcode_111001(uint32_t instruction, DecodedInstruction &insn) {
     auto function = instruction >> 28;
 
-    auto reg_d = (instruction >> 6) & 0b11111;
-    auto reg_a = (instruction >> 11) & 0b11111;
-    auto reg_b = (instruction >> 16) & 0b11111;
+    insn.shift_type = (instruction >> 26) & 0b11;
+    insn.shift_count = (instruction >> 21) & 0b11111;
+
+    if (!insn.reg_d && (function < 9 || function > 11))
+      return;
 
     switch (function) {
-    case 10: // FWC
-      raise_exception(EXC_FWCALL);
-      return true;
-    case 11: // RFE
-      m_locked = false;
-      m_pc = m_ctl_regs[CTL_EPC];
-      m_ctl_regs[CTL_RS] = m_ctl_regs[CTL_ERS];
-      return true;
-    case 12: // HLT
-      m_halt = true;
-      return true;
-    case 13: // FTLB
-      // TODO: Implement flushing TLB
-      return true;
-    case 14: // MTCR
-      m_ctl_regs[reg_b] = m_regs[reg_a];
-      return true;
-    case 15: // MFCR
-      if (reg_d != 0)
-        m_regs[reg_d] = m_ctl_regs[reg_b];
-      return true;
+    case 0: insn.op = OP_NOR; break;             // NOR
+    case 1: insn.op = OP_OR; break;              // OR
+    case 2: insn.op = OP_XOR; break;             // XOR
+    case 3: insn.op = OP_AND; break;             // AND
+    case 4: insn.op = OP_SLT_SIGNED; break;      // SLT signed
+    case 5: insn.op = OP_SLT; break;             // SLT
+    case 6: insn.op = OP_SUB; break;             // SUB
+    case 7: insn.op = OP_ADD; break;             // ADD
+    case 8: insn.op = OP_SHIFT; break;           // Shift
+    case 9: insn.op = OP_STORE_REG_LONG; break;  // Move reg_d to long[reg_a + reg_b]
+    case 10: insn.op = OP_STORE_REG_INT; break;  // Move reg_d to int[reg_a + reg_b]
+    case 11: insn.op = OP_STORE_REG_BYTE; break; // Move reg_d to byte[reg_a + reg_b]
+    case 13: insn.op = OP_LOAD_REG_LONG; break;  // Move long[reg_a + reg_b] to reg_d
+    case 14: insn.op = OP_LOAD_REG_INT; break;   // Move int[reg_a + reg_b] to reg_d
+    case 15: insn.op = OP_LOAD_REG_BYTE; break;  // Move byte[reg_a + reg_b] to reg_d
     }
+  }
 
-    raise_exception(EXC_INVINST);
-    return false;
+  static void decode_opcode_110001(uint32_t instruction, DecodedInstruction &insn) {
+    auto function = instruction >> 28;
+    auto writes_reg_d = insn.reg_d != 0;
+
+    switch (function) {
+    case 0: // SYS
+      insn.op = OP_SYS;
+      insn.ends_block = true;
+      break;
+    case 1: // BRK
+      insn.op = OP_BRK;
+      insn.ends_block = true;
+      break;
+    case 8: insn.op = OP_SC; break;                                  // SC
+    case 9: insn.op = OP_LL; break;                                  // LL
+    case 11: insn.op = writes_reg_d ? OP_MOD : OP_NOP; break;        // MOD
+    case 12: insn.op = writes_reg_d ? OP_DIV_SIGNED : OP_NOP; break; // DIV signed
+    case 13: insn.op = writes_reg_d ? OP_DIV : OP_NOP; break;        // DIV
+    case 15: insn.op = writes_reg_d ? OP_MUL : OP_NOP; break;        // MUL
+    }
+  }
+
+  static void decode_opcode_101001(uint32_t instruction, DecodedInstruction &insn) {
+    auto function = instruction >> 28;
+
+    // Everything in this group may change the CPU state the rest of the block was decoded under.
+    insn.op = OP_INVALID_PRIVILEGED;
+    insn.ends_block = true;
+
+    switch (function) {
+    case 10: insn.op = OP_FWC; break;  // FWC
+    case 11: insn.op = OP_RFE; break;  // RFE
+    case 12: insn.op = OP_HLT; break;  // HLT
+    case 13: insn.op = OP_FTLB; break; // FTLB
+    case 14: insn.op = OP_MTCR; break; // MTCR
+    case 15: insn.op = OP_MFCR; break; // MFCR
+    }
   }
 
-  bool handle_opcode_major(uint32_t major_op, uint32_t instruction, uint32_t current_pc) {
+  static void decode_opcode_major(uint32_t major_op, uint32_t instruction, DecodedInstruction &insn) {
     auto imm = instruction >> 16;
-    auto reg_d = (instruction >> 6) & 0b11111;
-    auto reg_a = (instruction >> 11) & 0b11111;
 
     switch (major_op) {
     case 61: // BEQ
-      if (m_regs[reg_d] == 0)
-        m_pc = current_pc + sign_ext_23((instruction >> 11) << 2);
-      return true;
     case 53: // BNE
-      if (m_regs[reg_d] != 0)
-        m_pc = current_pc + sign_ext_23((instruction >> 11) << 2);
-      return true;
     case 45: // BLT
-      if ((int32_t)m_regs[reg_d] < 0)
-        m_pc = current_pc + sign_ext_23((instruction >> 11) << 2);
-      return true;
-    case 60: // ADDI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] + imm;
-      return true;
-    case 52: // SUBI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] - imm;
-      return true;
-    case 44: // SLTI
-      if (reg_d != 0)
-        m_regs[reg_d] = less_than(m_regs[reg_a], imm, false);
+      insn.op = major_op == 61 ? OP_BEQ : major_op == 53 ? OP_BNE : OP_BLT;
+      insn.imm = sign_ext_23((instruction >> 11) << 2);
+      insn.ends_block = true;
+      return;
+    case 56: // JALR
+      insn.op = OP_JALR;
+      insn.imm = sign_ext_18(imm << 2);
+      insn.ends_block = true;
+      return;
+    }
+
+    switch (major_op) {
+    case 60: insn.op = OP_ADDI; break; // ADDI
+    case 52: insn.op = OP_SUBI; break; // SUBI
+    case 44: insn.op = OP_SLTI; break; // SLTI
+    case 36:                           // SLTI signed
+      insn.op = OP_SLTI_SIGNED;
+      imm = sign_ext_16(imm);
+      break;
+    case 28: insn.op = OP_ANDI; break; // ANDI
+    case 20: insn.op = OP_XORI; break; // XORI
+    case 12: insn.op = OP_ORI; break;  // ORI
+    case 4:                            // LUI
+      insn.op = OP_ORI;
+      imm <<= 16;
+      break;
+    case 59: insn.op = OP_LOAD_IMM_BYTE; break; // Move byte[reg_a + imm] into reg_d
+    case 51:                                    // Move int[reg_a + imm] into reg_d
+      insn.op = OP_LOAD_IMM_INT;
+      imm <<= 1;
+      break;
+    case 43: // Move long[reg_a + imm] into reg_d
+      insn.op = OP_LOAD_IMM_LONG;
+      imm <<= 2;
+      break;
+    case 58: insn.op = OP_STORE_IMM_BYTE; break; // Move reg_a into byte[reg_d + imm]
+    case 50:                                     // Move reg_a into int[reg_d + imm]
+      insn.op = OP_STORE_IMM_INT;
+      imm <<= 1;
+      break;
+    case 42: // Move reg_a into long[reg_d + imm]
+      insn.op = OP_STORE_IMM_LONG;
+      imm <<= 2;
+      break;
+    case 26: insn.op = OP_STORE_IMM5_BYTE; break; // Move reg_a into byte[reg_d + imm5]
+    case 18:                                      // Move reg_a into int[reg_d + imm5]
+      insn.op = OP_STORE_IMM5_INT;
+      imm <<= 1;
+      break;
+    case 10: // Move reg_a into long[reg_d + imm5]
+      insn.op = OP_STORE_IMM5_LONG;
+      imm <<= 2;
+      break;
+    default: return;
+    }
+
+    insn.imm = imm;
+
+    // Everything but the stores (0bxxx010) writes reg_d, and has no effect at all when that's r0
+    if (!insn.reg_d && (major_op & 0b111) != 0b010)
+      insn.op = OP_NOP;
+  }
+
+  bool execute_compiled(uint32_t pc) {
+    auto block = m_compiled;
+
+    m_compiled = nullptr;
+    m_compiled_ok = true;
+    m_compiled_start = block->instructions.data();
+    m_block_generation = m_code_cache.generation();
+    m_retired += block->compiled(this, m_regs, pc, &m_pc);
+
+    return m_compiled_ok;
+  }
+
+  // Called from translated code for everything it doesn't handle inline. Returning false makes the
+  // block exit, which also has to happen whenever the interpreter would stop before the next instruction.
+  static bool jit_call(Cpu *cpu, const DecodedInstruction *insn) {
+    if (!(cpu->*insn->handler)(*insn)) {
+      cpu->m_compiled_ok = false;
+      return false;
+    }
+
+    if (cpu->exception_pending())
+      return false;
+
+    // A device may have pulled the deadline in; `m_retired` only catches up once the block exits.
+    if ((uint64_t)(insn - cpu->m_compiled_start) + 1 >= cpu->m_run_end - cpu->m_retired)
+      return false;
+
+    return cpu->m_code_cache.generation() == cpu->m_block_generation;
+  }
+
+  // Register allocation: rbx = guest registers, r12 = `this`, r13d = block PC, r14 = `&m_pc`.
+  // Guest registers live in memory; the ALU and control-flow instructions are inlined, and
+  // anything touching memory or CPU state goes through `jit_call`.
+  void compile_block(DecodedBlock &block) {
+#ifdef LS_EMU_HAS_JIT
+    X86Emitter code;
+    std::vector<size_t> exits;
+
+    code.push(X86_EBX);
+    code.push(X86_R12);
+    code.push(X86_R13);
+    code.push(X86_R14);
+    code.add_rsp(-8);
+    code.mov_reg64(X86_EBX, X86_ESI);
+    code.mov_reg64(X86_R12, X86_EDI);
+    code.mov_reg32(X86_R13, X86_EDX);
+    code.mov_reg64(X86_R14, X86_ECX);
+
+    auto pc_written = false;
+
+    for (size_t i = 0; i < block.instructions.size(); i++) {
+      auto &insn = block.instructions[i];
+      auto offset = (int32_t)i * 4;
+
+      if (emit_inline(code, insn, offset, pc_written))
+        continue;
+
+      code.lea32(X86_EAX, X86_R13, offset + 4);
+      code.store32(X86_R14, 0, X86_EAX);
+      code.mov_reg64(X86_EDI, X86_R12);
+      code.mov_imm64(X86_ESI, (uint64_t)&insn);
+      code.mov_imm64(X86_EAX, (uint64_t)&Cpu::jit_call);
+      code.call(X86_EAX);
+      code.test8(X86_EAX);
+      code.jnz_short(10);
+      code.mov_imm32(X86_EAX, i + 1);
+      exits.push_back(code.jmp_forward());
+
+      pc_written = true;
+    }
+
+    if (!pc_written) {
+      code.lea32(X86_EAX, X86_R13, block.instructions.size() * 4);
+      code.store32(X86_R14, 0, X86_EAX);
+    }
+
+    code.mov_imm32(X86_EAX, block.instructions.size());
+
+    for (auto exit : exits)
+      code.patch_jump(exit, code.size());
+
+    code.add_rsp(8);
+    code.pop(X86_R14);
+    code.pop(X86_R13);
+    code.pop(X86_R12);
+    code.pop(X86_EBX);
+    code.ret();
+
+    auto memory = m_jit_arena->allocate(code.size());
+    if (!memory) {
+      // Out of space: throw every translation away and let blocks warm up again.
+      m_code_cache.flush();
+      m_jit_arena->reset();
+      return;
+    }
+
+    memcpy(memory, code.data(), code.size());
+    block.compiled = (CompiledBlock)memory;
+#endif
+  }
+
+  // Emits host code for `insn` if it can run without the interpreter. `pc_written` tracks
+  // whether `m_pc` already holds the right value should the block end after this instruction.
+  static bool emit_inline(X86Emitter &code, const DecodedInstruction &insn, int32_t offset, bool &pc_written) {
+    struct AluOp {
+      uint8_t op;
+      X86AluOp x86_op;
+    };
+
+    static const AluOp reg_ops[] = {
+        {OP_ADD, X86_ADD}, {OP_SUB, X86_SUB}, {OP_AND, X86_AND},
+        {OP_OR, X86_OR},   {OP_XOR, X86_XOR}, {OP_NOR, X86_OR},
+    };
+
+    static const AluOp imm_ops[] = {
+        {OP_ADDI, X86_ADD}, {OP_SUBI, X86_SUB}, {OP_ANDI, X86_AND},
+        {OP_ORI, X86_OR},   {OP_XORI, X86_XOR},
+    };
+
+    auto reg_d = insn.reg_d * 4;
+    auto reg_a = insn.reg_a * 4;
+    auto reg_b = insn.reg_b * 4;
+
+    if (insn.op == OP_NOP)
       return true;
-    case 36: // SLTI signed
-      if (reg_d != 0)
-        m_regs[reg_d] = less_than(m_regs[reg_a], sign_ext_16(imm), true);
+
+    if (!insn.shift_count) {
+      for (auto [op, x86_op] : reg_ops) {
+        if (insn.op != op)
+          continue;
+
+        code.load32(X86_EAX, X86_EBX, reg_a);
+        code.alu_mem(x86_op, X86_EAX, X86_EBX, reg_b);
+        if (op == OP_NOR)
+          code.not32(X86_EAX);
+        code.store32(X86_EBX, reg_d, X86_EAX);
+
+        pc_written = false;
+        return true;
+      }
+
+      if (insn.op == OP_SLT || insn.op == OP_SLT_SIGNED) {
+        code.load32(X86_EAX, X86_EBX, reg_a);
+        code.alu_mem(X86_CMP, X86_EAX, X86_EBX, reg_b);
+        code.setcc_zext(insn.op == OP_SLT ? X86_COND_B : X86_COND_L, X86_EAX);
+        code.store32(X86_EBX, reg_d, X86_EAX);
+
+        pc_written = false;
+        return true;
+      }
+    }
+
+    for (auto [op, x86_op] : imm_ops) {
+      if (insn.op != op)
+        continue;
+
+      code.load32(X86_EAX, X86_EBX, reg_a);
+      code.alu_imm(x86_op, X86_EAX, insn.imm);
+      code.store32(X86_EBX, reg_d, X86_EAX);
+
+      pc_written = false;
       return true;
-    case 28: // ANDI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] & imm;
+    }
+
+    if (insn.op == OP_SLTI || insn.op == OP_SLTI_SIGNED) {
+      code.load32(X86_EAX, X86_EBX, reg_a);
+      code.alu_imm(X86_CMP, X86_EAX, insn.imm);
+      code.setcc_zext(insn.op == OP_SLTI ? X86_COND_B : X86_COND_L, X86_EAX);
+      code.store32(X86_EBX, reg_d, X86_EAX);
+
+      pc_written = false;
       return true;
-    case 20: // XORI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] ^ imm;
+    }
+
+    if (insn.op == OP_MUL) {
+      code.load32(X86_EAX, X86_EBX, reg_a);
+      code.imul_mem(X86_EAX, X86_EBX, reg_b);
+      code.store32(X86_EBX, reg_d, X86_EAX);
+
+      pc_written = false;
       return true;
-    case 12: // ORI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] | imm;
+    }
+
+    if (insn.op == OP_BEQ || insn.op == OP_BNE || insn.op == OP_BLT) {
+      auto cond = insn.op == OP_BEQ ? X86_COND_E : insn.op == OP_BNE ? X86_COND_NE : X86_COND_L;
+
+      code.lea32(X86_EAX, X86_R13, offset + 4);
+      code.lea32(X86_ECX, X86_R13, offset + insn.imm);
+      code.cmp_mem_zero(X86_EBX, reg_d);
+      code.cmov(cond, X86_EAX, X86_ECX);
+      code.store32(X86_R14, 0, X86_EAX);
+
+      pc_written = true;
       return true;
-    case 4: // LUI
-      if (reg_d != 0)
-        m_regs[reg_d] = m_regs[reg_a] | imm << 16;
+    }
+
+    if (insn.op == OP_J || insn.op == OP_JAL) {
+      if (insn.op == OP_JAL) {
+        code.lea32(X86_ECX, X86_R13, offset + 4);
+        code.store32(X86_EBX, REG_LR * 4, X86_ECX);
+      }
+
+      code.lea32(X86_EAX, X86_R13, offset);
+      code.alu_imm(X86_AND, X86_EAX, 0x80000000);
+      code.alu_imm(X86_OR, X86_EAX, insn.imm);
+      code.store32(X86_R14, 0, X86_EAX);
+
+      pc_written = true;
       return true;
-    case 56: // JALR
-      if (reg_d != 0)
-        m_regs[reg_d] = m_pc;
-      m_pc = m_regs[reg_a] + sign_ext_18(imm << 2);
+    }
+
+    if (insn.op == OP_JALR) {
+      if (insn.reg_d != 0) {
+        code.lea32(X86_EAX, X86_R13, offset + 4);
+        code.store32(X86_EBX, reg_d, X86_EAX);
+      }
+
+      code.load32(X86_EAX, X86_EBX, reg_a);
+      code.alu_imm(X86_ADD, X86_EAX, insn.imm);
+      code.store32(X86_R14, 0, X86_EAX);
+
+      pc_written = true;
       return true;
-    case 59: return reg_d ? mem_read(m_regs[reg_a] + imm, BUS_BYTE, m_regs[reg_d]) : true;        // Move byte[reg_a + imm] into reg_d
-    case 51: return reg_d ? mem_read(m_regs[reg_a] + (imm << 1), BUS_INT, m_regs[reg_d]) : true;  // Move int[reg_a + imm] into reg_d
-    case 43: return reg_d ? mem_read(m_regs[reg_a] + (imm << 2), BUS_LONG, m_regs[reg_d]) : true; // Move long[reg_a + imm] into reg_d
-    case 58: return mem_write(m_regs[reg_d] + imm, BUS_BYTE, m_regs[reg_a]);                      // Move reg_a into byte[reg_d + imm]
-    case 50: return mem_write(m_regs[reg_d] + (imm << 1), BUS_INT, m_regs[reg_a]);                // Move reg_a into int[reg_d + imm]
-    case 42: return mem_write(m_regs[reg_d] + (imm << 2), BUS_LONG, m_regs[reg_a]);               // Move reg_a into long[reg_d + imm]
-    case 26: return mem_write(m_regs[reg_d] + imm, BUS_BYTE, sign_ext_5(reg_a));                  // Move reg_a into byte[reg_d + imm5]
-    case 18: return mem_write(m_regs[reg_d] + (imm << 1), BUS_INT, sign_ext_5(reg_a));            // Move reg_a into int[reg_d + imm5]
-    case 10: return mem_write(m_regs[reg_d] + (imm << 2), BUS_LONG, sign_ext_5(reg_a));           // Move reg_a into long[reg_d + imm5]
     }
 
+    return false;
+  }
+
+  uint32_t shifted_reg_b(const DecodedInstruction &insn) const {
+    return insn.shift_count ? shift(m_regs[insn.reg_b], insn.shift_count, insn.shift_type) : m_regs[insn.reg_b];
+  }
+
+  bool privileged() {
+    if (m_ctl_regs[CTL_RS] & RS_USER) {
+      raise_exception(EXC_INVPRVG);
+      return false;
+    }
+
+    return true;
+  }
+
+  bool op_nop(const DecodedInstruction &insn) {
+    return true;
+  }
+
+  bool op_invalid(const DecodedInstruction &insn) {
+    raise_exception(EXC_INVINST);
+    return false;
+  }
+
+  bool op_invalid_privileged(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
     raise_exception(EXC_INVINST);
     return false;
   }
 
+  bool op_jal(const DecodedInstruction &insn) {
+    m_regs[REG_LR] = m_pc;
+    m_pc = ((m_pc - 4) & 0x80000000) | insn.imm;
+    return true;
+  }
+
+  bool op_j(const DecodedInstruction &insn) {
+    m_pc = ((m_pc - 4) & 0x80000000) | insn.imm;
+    return true;
+  }
+
+  bool op_nor(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = ~(m_regs[insn.reg_a] | shifted_reg_b(insn));
+    return true;
+  }
+
+  bool op_or(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] | shifted_reg_b(insn);
+    return true;
+  }
+
+  bool op_xor(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] ^ shifted_reg_b(insn);
+    return true;
+  }
+
+  bool op_and(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] & shifted_reg_b(insn);
+    return true;
+  }
+
+  bool op_slt_signed(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = less_than(m_regs[insn.reg_a], shifted_reg_b(insn), true);
+    return true;
+  }
+
+  bool op_slt(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = less_than(m_regs[insn.reg_a], shifted_reg_b(insn), false);
+    return true;
+  }
+
+  bool op_sub(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] - shifted_reg_b(insn);
+    return true;
+  }
+
+  bool op_add(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] + shifted_reg_b(insn);
+    return true;
+  }
+
+  bool op_shift(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = shift(m_regs[insn.reg_b], m_regs[insn.reg_a], insn.shift_type);
+    return true;
+  }
+
+  template <BusSize size>
+  bool op_store_reg(const DecodedInstruction &insn) {
+    return mem_write(m_regs[insn.reg_a] + shifted_reg_b(insn), size, m_regs[insn.reg_d] & bus_mask(size));
+  }
+
+  template <BusSize size>
+  bool op_load_reg(const DecodedInstruction &insn) {
+    return mem_read(m_regs[insn.reg_a] + shifted_reg_b(insn), size, m_regs[insn.reg_d]);
+  }
+
+  bool op_sys(const DecodedInstruction &insn) {
+    raise_exception(EXC_SYSCALL);
+    return true;
+  }
+
+  bool op_brk(const DecodedInstruction &insn) {
+    raise_exception(EXC_BRKPOINT);
+    return true;
+  }
+
+  bool op_sc(const DecodedInstruction &insn) {
+    if (m_locked && !mem_write(m_regs[insn.reg_a], BUS_LONG, m_regs[insn.reg_b]))
+      return false;
+    if (insn.reg_d != 0)
+      m_regs[insn.reg_d] = m_locked;
+    return true;
+  }
+
+  bool op_ll(const DecodedInstruction &insn) {
+    m_locked = true;
+    if (insn.reg_d != 0 && !mem_read(m_regs[insn.reg_a], BUS_LONG, m_regs[insn.reg_d]))
+      return false;
+    return true;
+  }
+
+  bool op_mod(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_b] ? m_regs[insn.reg_a] % m_regs[insn.reg_b] : 0;
+    return true;
+  }
+
+  bool op_div_signed(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_b] ? (int32_t)m_regs[insn.reg_a] / (int32_t)m_regs[insn.reg_b] : 0;
+    return true;
+  }
+
+  bool op_div(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_b] ? m_regs[insn.reg_a] / m_regs[insn.reg_b] : 0;
+    return true;
+  }
+
+  bool op_mul(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] * m_regs[insn.reg_b];
+    return true;
+  }
+
+  bool op_fwc(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    raise_exception(EXC_FWCALL);
+    return true;
+  }
+
+  bool op_rfe(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    m_locked = false;
+    m_pc = m_ctl_regs[CTL_EPC];
+    m_ctl_regs[CTL_RS] = m_ctl_regs[CTL_ERS];
+    return true;
+  }
+
+  bool op_hlt(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    m_halt = true;
+    return true;
+  }
+
+  bool op_ftlb(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    // Register A holds the ASID and register B the virtual page number. All ones in both is
+    // the form that flushes every entry.
+    auto asid = m_regs[insn.reg_a];
+    auto vpn = m_regs[insn.reg_b];
+
+    if (asid == UINT32_MAX && vpn == UINT32_MAX) {
+      m_itlb.flush();
+      m_dtlb.flush();
+    } else {
+      m_itlb.invalidate(vpn, asid);
+      m_dtlb.invalidate(vpn, asid);
+    }
+
+    return true;
+  }
+
+  bool op_mtcr(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    m_ctl_regs[insn.reg_b] = m_regs[insn.reg_a];
+
+    // A new page table base invalidates every cached translation, whatever its ASID.
+    if (insn.reg_b == CTL_PGTB) {
+      m_itlb.flush();
+      m_dtlb.flush();
+    }
+
+    return true;
+  }
+
+  bool op_mfcr(const DecodedInstruction &insn) {
+    if (!privileged())
+      return false;
+
+    if (insn.reg_d != 0)
+      m_regs[insn.reg_d] = m_ctl_regs[insn.reg_b];
+    return true;
+  }
+
+  bool op_beq(const DecodedInstruction &insn) {
+    if (m_regs[insn.reg_d] == 0)
+      m_pc = m_pc - 4 + insn.imm;
+    return true;
+  }
+
+  bool op_bne(const DecodedInstruction &insn) {
+    if (m_regs[insn.reg_d] != 0)
+      m_pc = m_pc - 4 + insn.imm;
+    return true;
+  }
+
+  bool op_blt(const DecodedInstruction &insn) {
+    if ((int32_t)m_regs[insn.reg_d] < 0)
+      m_pc = m_pc - 4 + insn.imm;
+    return true;
+  }
+
+  bool op_addi(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] + insn.imm;
+    return true;
+  }
+
+  bool op_subi(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] - insn.imm;
+    return true;
+  }
+
+  bool op_slti(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = less_than(m_regs[insn.reg_a], insn.imm, false);
+    return true;
+  }
+
+  bool op_slti_signed(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = less_than(m_regs[insn.reg_a], insn.imm, true);
+    return true;
+  }
+
+  bool op_andi(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] & insn.imm;
+    return true;
+  }
+
+  bool op_xori(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] ^ insn.imm;
+    return true;
+  }
+
+  bool op_ori(const DecodedInstruction &insn) {
+    m_regs[insn.reg_d] = m_regs[insn.reg_a] | insn.imm;
+    return true;
+  }
+
+  bool op_jalr(const DecodedInstruction &insn) {
+    if (insn.reg_d != 0)
+      m_regs[insn.reg_d] = m_pc;
+    m_pc = m_regs[insn.reg_a] + insn.imm;
+    return true;
+  }
+
+  template <BusSize size>
+  bool op_load_imm(const DecodedInstruction &insn) {
+    return mem_read(m_regs[insn.reg_a] + insn.imm, size, m_regs[insn.reg_d]);
+  }
+
+  template <BusSize size>
+  bool op_store_imm(const DecodedInstruction &insn) {
+    return mem_write(m_regs[insn.reg_d] + insn.imm, size, m_regs[insn.reg_a]);
+  }
+
+  template <BusSize size>
+  bool op_store_imm5(const DecodedInstruction &insn) {
+    return mem_write(m_regs[insn.reg_d] + insn.imm, size, sign_ext_5(insn.reg_a));
+  }
+
 private:
   Bus &m_bus;
   InterruptController &m_int_ctl;
+  BlockCache &m_code_cache;
+
+  std::unique_ptr<JitArena> m_jit_arena;
+
+  Tlb m_itlb;
+  Tlb m_dtlb;
+
+  DecodedBlock *m_block = nullptr;
+  DecodedBlock *m_compiled = nullptr;
+  const DecodedInstruction *m_compiled_start = nullptr;
+  DecodedInstruction m_uncached;
+
+  uint32_t m_block_pc = 0;
+  uint32_t m_block_index = 0;
+  uint64_t m_block_generation = 0;
+
+  uint64_t m_retired = 0;
+  uint64_t m_deadline = UINT64_MAX;
+  uint64_t m_run_end = 0;
+
+  std::atomic<bool> m_stop_requested = false;
 
   uint32_t m_pc = 0;
   uint32_t m_exc = 0;
@@ -504,4 +1374,6 @@ private:
 
   bool m_halt = false;
   bool m_locked = false;
+  bool m_compiled_ok = true;
+  bool m_threaded = true;
 };
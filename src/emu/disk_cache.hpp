@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "disk_image.hpp"
+#include "disk_profile.hpp"
+
+struct DiskCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t prefetched = 0;
+  uint64_t prefetch_hits = 0; // Prefetched blocks that were read before being evicted
+  uint64_t warmed = 0;        // Blocks prefetched from a boot profile, also counted as prefetched
+};
+
+// An LRU cache of blocks in front of another image. Once the guest reads a few blocks in a row,
+// the blocks after them are fetched on a background thread ahead of it. The same thread can warm
+// the cache with the blocks a boot profile lists. Writes go straight through to the image, and
+// into the cache.
+class CachedDiskImage final : public DiskImage {
+  struct Entry {
+    uint32_t block;
+    bool prefetched;
+    uint8_t data[block_size];
+  };
+
+  constexpr static uint32_t sequential_threshold = 4;
+  constexpr static uint32_t readahead_blocks = 128;
+
+  constexpr static uint32_t max_profile_blocks = max_disk_profile_blocks;
+
+public:
+  CachedDiskImage(std::unique_ptr<DiskImage> image, size_t size_mib)
+      : m_image(std::move(image)), m_capacity(std::max<size_t>(size_mib * 1024 * 1024 / block_size, readahead_blocks * 2)) {
+    m_prefetcher = std::thread([this] { prefetch(); });
+  }
+
+  ~CachedDiskImage() {
+    {
+      std::lock_guard lock(m_prefetch_mutex);
+      m_stopping = true;
+    }
+
+    m_prefetch_wake.notify_one();
+    m_prefetcher.join();
+  }
+
+  uint32_t block_count() const override {
+    return m_image->block_count();
+  }
+
+  void read_block(uint32_t block, uint8_t *data) override {
+    detect_sequential(block);
+
+    {
+      std::lock_guard lock(m_cache_mutex);
+
+      if (m_recording)
+        record(block);
+
+      if (auto entry = find(block)) {
+        memcpy(data, entry->data, block_size);
+
+        m_stats.hits++;
+        if (entry->prefetched) {
+          m_stats.prefetch_hits++;
+          entry->prefetched = false;
+        }
+        return;
+      }
+
+      m_stats.misses++;
+    }
+
+    std::lock_guard lock(m_image_mutex);
+    m_image->read_block(block, data);
+
+    std::lock_guard cache_lock(m_cache_mutex);
+    insert(block, data, false);
+  }
+
+  void write_block(uint32_t block, const uint8_t *data) override {
+    std::lock_guard lock(m_image_mutex);
+    m_image->write_block(block, data);
+
+    // Always cached, even on a miss: a prefetch of the old contents may be about to land.
+    std::lock_guard cache_lock(m_cache_mutex);
+    insert(block, data, false);
+  }
+
+  // Cached copies are zeroed to match, rather than dropped.
+  void discard_blocks(uint32_t block, uint32_t count) override {
+    std::lock_guard lock(m_image_mutex);
+    m_image->discard_blocks(block, count);
+
+    std::lock_guard cache_lock(m_cache_mutex);
+    for (auto &entry : m_lru) {
+      if (entry.block >= block && entry.block - block < count)
+        memset(entry.data, 0, block_size);
+    }
+  }
+
+  DiskCacheStats stats() {
+    std::lock_guard lock(m_cache_mutex);
+    return m_stats;
+  }
+
+  // Queues `blocks` to be read into the cache in the background, behind any guest read-ahead. The
+  // cache grows to hold them all, so warming never evicts what it warmed earlier; past the size
+  // of a profile, the rest are dropped rather than let the cache grow any further.
+  void warm(std::vector<uint32_t> blocks) {
+    std::erase_if(blocks, [this](auto block) { return block >= block_count(); });
+    if (blocks.size() > max_profile_blocks)
+      blocks.resize(max_profile_blocks);
+
+    {
+      std::lock_guard lock(m_cache_mutex);
+      m_capacity = std::max(m_capacity, blocks.size() + readahead_blocks * 2);
+    }
+
+    std::lock_guard lock(m_prefetch_mutex);
+    m_warm = std::move(blocks);
+    m_warm_next = 0;
+    m_prefetch_wake.notify_one();
+  }
+
+  // Starts keeping track of the order blocks are first read in, for `profile`.
+  void record_profile() {
+    std::lock_guard lock(m_cache_mutex);
+    m_recording = true;
+    m_profiled.assign((block_count() + 7) / 8, 0);
+  }
+
+  std::vector<uint32_t> profile() {
+    std::lock_guard lock(m_cache_mutex);
+    return m_profile;
+  }
+
+private:
+  // Only called from the thread doing the guest's reads.
+  void detect_sequential(uint32_t block) {
+    m_run = block == m_last_read + 1 ? m_run + 1 : 0;
+    m_last_read = block;
+
+    if (m_run < sequential_threshold) {
+      m_readahead_end = 0;
+      return;
+    }
+
+    // Top up the window once the guest is halfway through it.
+    if (block + readahead_blocks / 2 < m_readahead_end)
+      return;
+
+    auto first = std::max(block + 1, m_readahead_end);
+    m_readahead_end = std::min<uint64_t>((uint64_t)block + 1 + readahead_blocks, block_count());
+
+    std::lock_guard lock(m_prefetch_mutex);
+    m_prefetch_next = first;
+    m_prefetch_end = m_readahead_end;
+    m_prefetch_wake.notify_one();
+  }
+
+  // The caller holds `m_cache_mutex`.
+  void record(uint32_t block) {
+    if (m_profiled[block / 8] & (1 << (block % 8)) || m_profile.size() >= max_profile_blocks)
+      return;
+
+    m_profiled[block / 8] |= 1 << (block % 8);
+    m_profile.push_back(block);
+  }
+
+  // Takes one block at a time, so a newer request replaces whatever is left of the old one.
+  // Read-ahead comes first: the guest is waiting on it, while warming is only a guess.
+  void prefetch() {
+    uint8_t data[block_size];
+    std::unique_lock lock(m_prefetch_mutex);
+
+    while (true) {
+      m_prefetch_wake.wait(lock, [this] { return m_stopping || m_prefetch_next < m_prefetch_end || m_warm_next < m_warm.size(); });
+      if (m_stopping)
+        return;
+
+      auto warming = m_prefetch_next >= m_prefetch_end;
+      auto block = warming ? m_warm[m_warm_next++] : m_prefetch_next++;
+      lock.unlock();
+
+      {
+        std::lock_guard image_lock(m_image_mutex);
+
+        auto cached = [&] {
+          std::lock_guard cache_lock(m_cache_mutex);
+          return find(block, false) != nullptr;
+        }();
+
+        if (!cached) {
+          m_image->read_block(block, data);
+
+          std::lock_guard cache_lock(m_cache_mutex);
+          insert(block, data, true);
+          m_stats.prefetched++;
+          if (warming)
+            m_stats.warmed++;
+        }
+      }
+
+      lock.lock();
+    }
+  }
+
+  // The caller holds `m_cache_mutex`.
+  Entry *find(uint32_t block, bool touch = true) {
+    auto it = m_index.find(block);
+    if (it == m_index.end())
+      return nullptr;
+
+    if (touch)
+      m_lru.splice(m_lru.begin(), m_lru, it->second);
+
+    return &*it->second;
+  }
+
+  // The caller holds `m_cache_mutex`.
+  void insert(uint32_t block, const uint8_t *data, bool prefetched) {
+    auto entry = find(block);
+
+    if (!entry) {
+      if (m_index.size() >= m_capacity) {
+        m_index.erase(m_lru.back().block);
+        m_lru.splice(m_lru.begin(), m_lru, std::prev(m_lru.end()));
+      } else {
+        m_lru.emplace_front();
+      }
+
+      entry = &m_lru.front();
+      entry->block = block;
+      m_index[block] = m_lru.begin();
+    }
+
+    entry->prefetched = prefetched;
+    memcpy(entry->data, data, block_size);
+  }
+
+  std::unique_ptr<DiskImage> m_image;
+  std::mutex m_image_mutex; // Taken before `m_cache_mutex` when both are needed
+
+  std::list<Entry> m_lru;
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> m_index;
+  size_t m_capacity;
+  DiskCacheStats m_stats;
+  std::mutex m_cache_mutex;
+
+  bool m_recording = false;
+  std::vector<uint8_t> m_profiled; // Bitmap of the blocks already in `m_profile`
+  std::vector<uint32_t> m_profile;
+
+  uint32_t m_last_read = UINT32_MAX - 1;
+  uint32_t m_run = 0;
+  uint32_t m_readahead_end = 0;
+
+  std::thread m_prefetcher;
+  std::mutex m_prefetch_mutex;
+  std::condition_variable m_prefetch_wake;
+  uint32_t m_prefetch_next = 0;
+  uint32_t m_prefetch_end = 0;
+  std::vector<uint32_t> m_warm;
+  size_t m_warm_next = 0;
+  bool m_stopping = false;
+};
@@ -0,0 +1,695 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lz.hpp"
+
+enum DiskBackend : uint8_t {
+  DISK_BACKEND_FILE,
+  DISK_BACKEND_MMAP,
+  DISK_BACKEND_SPARSE,
+};
+
+// When writes are forced out to the host's storage. Anything not synced is still in the host
+// page cache and survives the emulator exiting, just not the host crashing.
+enum DiskSyncPolicy : uint8_t {
+  DISK_SYNC_NEVER,
+  DISK_SYNC_ON_CLOSE,
+  DISK_SYNC_EVERY_WRITE,
+};
+
+struct DiskOptions {
+  DiskBackend backend = DISK_BACKEND_FILE;
+  DiskSyncPolicy sync = DISK_SYNC_ON_CLOSE;
+  bool read_only = false;
+};
+
+// A disk as the controller sees it: a run of 512-byte blocks. Blocks may be read and written from
+// the disk I/O thread, but never from two threads at once. Writing to a read-only image is a bug.
+class DiskImage {
+public:
+  constexpr static uint32_t block_size = 512;
+
+  virtual ~DiskImage() = default;
+
+  virtual uint32_t block_count() const = 0;
+
+  virtual void read_block(uint32_t block, uint8_t *data) = 0;
+  virtual void write_block(uint32_t block, const uint8_t *data) = 0;
+
+  // Discarded blocks read back as zeroes. Images that can give the space back do that instead.
+  virtual void discard_blocks(uint32_t block, uint32_t count) {
+    uint8_t zeroes[block_size] = {};
+
+    for (uint32_t i = 0; i < count; i++)
+      write_block(block + i, zeroes);
+  }
+};
+
+// Frees the storage behind part of a file, which then reads as zeroes. Where the filesystem
+// can't do that, the zeroes are written out instead. Returns false if neither worked.
+inline bool punch_hole(int fd, off_t offset, off_t length) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    return true;
+
+  static const uint8_t zeroes[64 * 1024] = {};
+
+  while (length > 0) {
+    auto chunk = std::min<off_t>(length, sizeof(zeroes));
+    if (pwrite(fd, zeroes, chunk, offset) != chunk)
+      return false;
+
+    offset += chunk;
+    length -= chunk;
+  }
+
+  return true;
+}
+
+// Plain reads and writes on the image file.
+class FileDiskImage final : public DiskImage {
+public:
+  FileDiskImage(const std::filesystem::path &path, DiskSyncPolicy sync, bool read_only) : m_sync(read_only ? DISK_SYNC_NEVER : sync) {
+    m_fd = open(path.c_str(), (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (m_fd < 0)
+      throw std::runtime_error("Failed to open disk image");
+
+    m_block_count = lseek(m_fd, 0, SEEK_END) / block_size;
+  }
+
+  ~FileDiskImage() {
+    if (m_sync != DISK_SYNC_NEVER)
+      fsync(m_fd);
+
+    close(m_fd);
+  }
+
+  uint32_t block_count() const override {
+    return m_block_count;
+  }
+
+  // Short reads (past the end of a truncated image) come back as zeroes.
+  void read_block(uint32_t block, uint8_t *data) override {
+    auto count = std::max<ssize_t>(pread(m_fd, data, block_size, (off_t)block * block_size), 0);
+    memset(data + count, 0, block_size - count);
+  }
+
+  void write_block(uint32_t block, const uint8_t *data) override {
+    pwrite(m_fd, data, block_size, (off_t)block * block_size);
+
+    if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+private:
+  int m_fd;
+  uint32_t m_block_count;
+  DiskSyncPolicy m_sync;
+};
+
+// A plain file kept sparse: blocks written as all zeroes or discarded become holes. Reads that
+// land in a hole are answered without reading the file. Where the holes are is asked with
+// SEEK_DATA/SEEK_HOLE and remembered an extent at a time, so sequential reads only ask once per
+// extent. Filesystems without hole support simply look like one big extent of data.
+class SparseDiskImage final : public DiskImage {
+public:
+  SparseDiskImage(const std::filesystem::path &path, DiskSyncPolicy sync, bool read_only) : m_sync(read_only ? DISK_SYNC_NEVER : sync) {
+    m_fd = open(path.c_str(), (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (m_fd < 0)
+      throw std::runtime_error("Failed to open disk image");
+
+    m_file_size = lseek(m_fd, 0, SEEK_END);
+    m_block_count = m_file_size / block_size;
+
+    struct stat info;
+    if (fstat(m_fd, &info) == 0 && info.st_blksize > (blksize_t)block_size && !(info.st_blksize & (info.st_blksize - 1)))
+      m_host_block_size = info.st_blksize;
+
+    m_host_block.resize(m_host_block_size);
+  }
+
+  ~SparseDiskImage() {
+    if (m_sync != DISK_SYNC_NEVER)
+      fsync(m_fd);
+
+    close(m_fd);
+  }
+
+  uint32_t block_count() const override {
+    return m_block_count;
+  }
+
+  void read_block(uint32_t block, uint8_t *data) override {
+    auto offset = (off_t)block * block_size;
+
+    if (offset < m_extent_start || offset >= m_extent_end)
+      find_extent(offset);
+
+    if (m_extent_hole) {
+      memset(data, 0, block_size);
+      return;
+    }
+
+    auto count = std::max<ssize_t>(pread(m_fd, data, block_size, offset), 0);
+    memset(data + count, 0, block_size - count);
+  }
+
+  void write_block(uint32_t block, const uint8_t *data) override {
+    auto offset = (off_t)block * block_size;
+    m_extent_end = 0;
+
+    if (std::all_of(data, data + block_size, [](auto byte) { return byte == 0; }))
+      write_zeroes(offset);
+    else
+      pwrite(m_fd, data, block_size, offset);
+
+    if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+  void discard_blocks(uint32_t block, uint32_t count) override {
+    m_extent_end = 0;
+    punch_hole(m_fd, (off_t)block * block_size, (off_t)count * block_size);
+
+    if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+private:
+  // The filesystem only frees whole blocks of its own, so a hole is only worth punching once the
+  // host block around this one is all zeroes.
+  void write_zeroes(off_t offset) {
+    auto start = offset & ~(off_t)(m_host_block_size - 1);
+    auto size = std::max<ssize_t>(pread(m_fd, m_host_block.data(), m_host_block_size, start), 0);
+
+    memset(m_host_block.data() + (offset - start), 0, block_size);
+
+    if (std::all_of(m_host_block.begin(), m_host_block.begin() + size, [](auto byte) { return byte == 0; }))
+      punch_hole(m_fd, start, m_host_block_size);
+    else
+      pwrite(m_fd, m_host_block.data() + (offset - start), block_size, offset);
+  }
+
+  void find_extent(off_t offset) {
+    m_extent_start = offset;
+
+    auto data = lseek(m_fd, offset, SEEK_DATA);
+    if (data < 0) {
+      // Either nothing but a hole from here on, or no idea where the holes are.
+      m_extent_end = m_file_size;
+      m_extent_hole = errno == ENXIO;
+      return;
+    }
+
+    if (data > offset) {
+      m_extent_end = data;
+      m_extent_hole = true;
+      return;
+    }
+
+    auto hole = lseek(m_fd, offset, SEEK_HOLE);
+    m_extent_end = hole > offset ? hole : m_file_size;
+    m_extent_hole = false;
+  }
+
+  int m_fd;
+  off_t m_file_size;
+  uint32_t m_block_count;
+  DiskSyncPolicy m_sync;
+
+  uint32_t m_host_block_size = block_size;
+  std::vector<uint8_t> m_host_block;
+
+  // The extent the last read fell in, forgotten on every write.
+  off_t m_extent_start = 0;
+  off_t m_extent_end = 0;
+  bool m_extent_hole = false;
+};
+
+// The whole image mapped into memory, so a transfer is a memcpy and the host page cache does any
+// read-ahead. Only whole blocks are mapped; a trailing partial block is left out, as it is for files.
+class MappedDiskImage final : public DiskImage {
+public:
+  MappedDiskImage(const std::filesystem::path &path, DiskSyncPolicy sync, bool read_only) : m_sync(read_only ? DISK_SYNC_NEVER : sync) {
+    auto fd = open(path.c_str(), (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open disk image");
+
+    m_block_count = lseek(fd, 0, SEEK_END) / block_size;
+    m_size = (size_t)m_block_count * block_size;
+
+    if (m_size) {
+      auto memory = mmap(nullptr, m_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (memory == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Failed to map disk image");
+      }
+
+      m_memory = (uint8_t *)memory;
+    }
+
+    // The mapping keeps the file open.
+    close(fd);
+  }
+
+  ~MappedDiskImage() {
+    if (!m_memory)
+      return;
+
+    if (m_sync != DISK_SYNC_NEVER)
+      msync(m_memory, m_size, MS_SYNC);
+
+    munmap(m_memory, m_size);
+  }
+
+  uint32_t block_count() const override {
+    return m_block_count;
+  }
+
+  void read_block(uint32_t block, uint8_t *data) override {
+    memcpy(data, m_memory + (size_t)block * block_size, block_size);
+  }
+
+  // Syncing one block means syncing the host page it sits in.
+  void write_block(uint32_t block, const uint8_t *data) override {
+    auto offset = (size_t)block * block_size;
+    memcpy(m_memory + offset, data, block_size);
+
+    if (m_sync == DISK_SYNC_EVERY_WRITE) {
+      auto page_size = (size_t)sysconf(_SC_PAGESIZE);
+      auto page_start = offset & ~(page_size - 1);
+
+      msync(m_memory + page_start, std::min(offset + block_size, m_size) - page_start, MS_SYNC);
+    }
+  }
+
+private:
+  uint8_t *m_memory = nullptr;
+  size_t m_size;
+  uint32_t m_block_count;
+  DiskSyncPolicy m_sync;
+};
+
+// Copy-on-write layer over a base image that is never written, so any number of instances can
+// share one base. Changed blocks go to a delta file at the same offsets they'd have in the base,
+// leaving the file sparse, and a bitmap after the header records which blocks it holds. The
+// overlay can be committed into the base or simply deleted to discard it.
+class OverlayDiskImage final : public DiskImage {
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_count;
+    uint64_t data_offset;
+  };
+
+  constexpr static char magic[8] = {'L', 'S', 'O', 'V', 'R', 'L', 'A', 'Y'};
+  constexpr static uint32_t version = 1;
+  constexpr static uint64_t bitmap_offset = 4096;
+
+public:
+  OverlayDiskImage(std::unique_ptr<DiskImage> base, const std::filesystem::path &path, DiskSyncPolicy sync)
+      : m_base(std::move(base)), m_sync(sync) {
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+      throw std::runtime_error("Failed to open overlay image");
+
+    auto block_count = m_base->block_count();
+    m_bitmap.resize((block_count + 7) / 8, 0);
+
+    // The data starts on a host page boundary so hole punching and sparse copies line up.
+    m_data_offset = (bitmap_offset + m_bitmap.size() + 4095) & ~4095ull;
+
+    Header header;
+
+    if (lseek(m_fd, 0, SEEK_END) == 0) {
+      header = {{}, version, block_count, m_data_offset};
+      memcpy(header.magic, magic, sizeof(magic));
+
+      if (pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(m_fd, m_data_offset + (uint64_t)block_count * block_size) != 0)
+        fail("Failed to create overlay image");
+    } else {
+      if (pread(m_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, magic, sizeof(magic)) || header.version != version)
+        fail("Not an overlay image");
+
+      if (header.block_count != block_count || header.data_offset != m_data_offset)
+        fail("Overlay image doesn't match its base image");
+
+      if (pread(m_fd, m_bitmap.data(), m_bitmap.size(), bitmap_offset) != (ssize_t)m_bitmap.size())
+        fail("Failed to read overlay image");
+    }
+  }
+
+  ~OverlayDiskImage() {
+    if (m_sync != DISK_SYNC_NEVER)
+      fsync(m_fd);
+
+    close(m_fd);
+  }
+
+  uint32_t block_count() const override {
+    return m_base->block_count();
+  }
+
+  void read_block(uint32_t block, uint8_t *data) override {
+    if (!present(block)) {
+      m_base->read_block(block, data);
+      return;
+    }
+
+    auto count = std::max<ssize_t>(pread(m_fd, data, block_size, data_offset(block)), 0);
+    memset(data + count, 0, block_size - count);
+  }
+
+  // The block is synced before the bitmap first says it's there, so a crash never exposes a
+  // half-made block. A write that fails leaves the block as it was.
+  void write_block(uint32_t block, const uint8_t *data) override {
+    if (pwrite(m_fd, data, block_size, data_offset(block)) != (ssize_t)block_size)
+      return;
+
+    if (!present(block))
+      mark_present(block, 1);
+    else if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+  // The blocks' data becomes a hole, and they're marked as present so the base doesn't show through.
+  void discard_blocks(uint32_t block, uint32_t count) override {
+    if (!punch_hole(m_fd, data_offset(block), (off_t)count * block_size))
+      return;
+
+    auto newly_present = false;
+    for (auto i = block; i < block + count && !newly_present; i++)
+      newly_present = !present(i);
+
+    if (newly_present)
+      mark_present(block, count);
+    else if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+  // Writes every changed block into `base`, which must be the same image opened writable, and
+  // empties the overlay. Returns how many blocks were committed.
+  uint32_t commit(DiskImage &base) {
+    uint8_t data[block_size];
+    uint32_t committed = 0;
+
+    for (uint32_t block = 0; block < block_count(); block++) {
+      if (!present(block))
+        continue;
+
+      read_block(block, data);
+      base.write_block(block, data);
+      committed++;
+    }
+
+    std::fill(m_bitmap.begin(), m_bitmap.end(), 0);
+    pwrite(m_fd, m_bitmap.data(), m_bitmap.size(), bitmap_offset);
+
+    // Dropping the data and extending the file again leaves it all holes.
+    ftruncate(m_fd, m_data_offset);
+    ftruncate(m_fd, m_data_offset + (uint64_t)block_count() * block_size);
+
+    return committed;
+  }
+
+private:
+  [[noreturn]] void fail(const char *message) {
+    close(m_fd);
+    throw std::runtime_error(message);
+  }
+
+  bool present(uint32_t block) const {
+    return m_bitmap[block / 8] & (1 << (block % 8));
+  }
+
+  // Only once the blocks' data is on disk, and only if the bitmap makes it there as well; if it
+  // doesn't, the blocks stay as the bitmap on disk has them.
+  void mark_present(uint32_t block, uint32_t count) {
+    auto first_byte = block / 8;
+    auto last_byte = (block + count - 1) / 8;
+    auto old_bytes = std::vector<uint8_t>(m_bitmap.begin() + first_byte, m_bitmap.begin() + last_byte + 1);
+
+    fdatasync(m_fd);
+
+    for (auto i = block; i < block + count; i++)
+      m_bitmap[i / 8] |= 1 << (i % 8);
+
+    auto size = (ssize_t)(last_byte - first_byte + 1);
+    if (pwrite(m_fd, &m_bitmap[first_byte], size, bitmap_offset + first_byte) != size) {
+      std::copy(old_bytes.begin(), old_bytes.end(), m_bitmap.begin() + first_byte);
+      return;
+    }
+
+    if (m_sync == DISK_SYNC_EVERY_WRITE)
+      fdatasync(m_fd);
+  }
+
+  off_t data_offset(uint32_t block) const {
+    return m_data_offset + (off_t)block * block_size;
+  }
+
+  std::unique_ptr<DiskImage> m_base;
+  std::vector<uint8_t> m_bitmap;
+
+  int m_fd;
+  uint64_t m_data_offset;
+  DiskSyncPolicy m_sync;
+};
+
+// A read-only image stored as fixed-size chunks, each compressed on its own so any block can be
+// had by decompressing just its chunk. A table of chunk offsets follows the header; a chunk whose
+// stored size is its full size is kept as it is, and one with no stored bytes is all zeroes.
+// Recently used chunks stay decompressed.
+class CompressedDiskImage final : public DiskImage {
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t block_count;
+    uint32_t chunk_count;
+  };
+
+  struct Chunk {
+    uint32_t index = UINT32_MAX;
+    uint64_t last_used = 0;
+    std::vector<uint8_t> data;
+  };
+
+  constexpr static char magic[8] = {'L', 'S', 'C', 'O', 'M', 'P', 'R', 'S'};
+  constexpr static uint32_t version = 1;
+  constexpr static uint32_t cached_chunks = 16;
+
+public:
+  constexpr static uint32_t default_chunk_size = 64 * 1024;
+
+  explicit CompressedDiskImage(const std::filesystem::path &path) {
+    m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+      throw std::runtime_error("Failed to open disk image");
+
+    Header header;
+    if (pread(m_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, magic, sizeof(magic)) || header.version != version)
+      fail("Not a compressed disk image");
+
+    if (header.chunk_size == 0 || header.chunk_size % block_size ||
+        header.chunk_count != ((uint64_t)header.block_count * block_size + header.chunk_size - 1) / header.chunk_size)
+      fail("Damaged compressed disk image");
+
+    m_chunk_size = header.chunk_size;
+    m_block_count = header.block_count;
+    m_offsets.resize(header.chunk_count + 1);
+
+    auto index_size = (ssize_t)(m_offsets.size() * sizeof(uint64_t));
+    if (pread(m_fd, m_offsets.data(), index_size, sizeof(header)) != index_size)
+      fail("Damaged compressed disk image");
+
+    // Offsets only ever go up and stay inside the file, so a chunk's size can't be wild.
+    auto file_size = (uint64_t)lseek(m_fd, 0, SEEK_END);
+    for (size_t i = 0; i < m_offsets.size(); i++) {
+      if (m_offsets[i] > file_size || (i && m_offsets[i] < m_offsets[i - 1]) || (i && m_offsets[i] - m_offsets[i - 1] > m_chunk_size))
+        fail("Damaged compressed disk image");
+    }
+
+    m_chunks.resize(cached_chunks);
+  }
+
+  ~CompressedDiskImage() {
+    close(m_fd);
+  }
+
+  uint32_t block_count() const override {
+    return m_block_count;
+  }
+
+  void read_block(uint32_t block, uint8_t *data) override {
+    auto offset = (uint64_t)block * block_size;
+    auto &chunk = load_chunk(offset / m_chunk_size);
+
+    memcpy(data, chunk.data.data() + offset % m_chunk_size, block_size);
+  }
+
+  // Writable opens put an overlay on top to take the writes, so getting here is a bug.
+  void write_block(uint32_t, const uint8_t *) override {
+    fprintf(stderr, "Write to a read-only compressed disk image\n");
+    abort();
+  }
+
+  // Writes `source` to `path` in this format, replacing whatever was there.
+  static void create(DiskImage &source, const std::filesystem::path &path, uint32_t chunk_size = default_chunk_size) {
+    if (chunk_size == 0 || chunk_size % block_size)
+      throw std::runtime_error("Chunk size must be a multiple of the block size");
+
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create compressed disk image");
+
+    auto total_size = (uint64_t)source.block_count() * block_size;
+    auto chunk_count = (uint32_t)((total_size + chunk_size - 1) / chunk_size);
+
+    Header header = {{}, version, chunk_size, source.block_count(), chunk_count};
+    memcpy(header.magic, magic, sizeof(magic));
+
+    std::vector<uint64_t> offsets(chunk_count + 1);
+    offsets[0] = sizeof(header) + offsets.size() * sizeof(uint64_t);
+
+    std::vector<uint8_t> chunk(chunk_size);
+    auto ok = true;
+
+    for (uint32_t i = 0; i < chunk_count && ok; i++) {
+      auto size = (size_t)std::min<uint64_t>(chunk_size, total_size - (uint64_t)i * chunk_size);
+      auto first_block = (uint32_t)((uint64_t)i * chunk_size / block_size);
+
+      for (size_t offset = 0; offset < size; offset += block_size)
+        source.read_block(first_block + offset / block_size, chunk.data() + offset);
+
+      std::vector<uint8_t> stored;
+      if (std::any_of(chunk.begin(), chunk.begin() + size, [](auto byte) { return byte != 0; })) {
+        stored = lz_compress(chunk.data(), size);
+        if (stored.size() >= size)
+          stored.assign(chunk.begin(), chunk.begin() + size);
+      }
+
+      ok = pwrite(fd, stored.data(), stored.size(), offsets[i]) == (ssize_t)stored.size();
+      offsets[i + 1] = offsets[i] + stored.size();
+    }
+
+    ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    ok = ok && pwrite(fd, offsets.data(), offsets.size() * sizeof(uint64_t), sizeof(header)) == (ssize_t)(offsets.size() * sizeof(uint64_t));
+    close(fd);
+
+    if (!ok)
+      throw std::runtime_error("Failed to write compressed disk image");
+  }
+
+  static bool is_compressed(const std::filesystem::path &path) {
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+
+    char file_magic[sizeof(magic)];
+    auto matches = pread(fd, file_magic, sizeof(file_magic), 0) == sizeof(file_magic) && !memcmp(file_magic, magic, sizeof(magic));
+    close(fd);
+
+    return matches;
+  }
+
+private:
+  [[noreturn]] void fail(const char *message) {
+    close(m_fd);
+    throw std::runtime_error(message);
+  }
+
+  // A chunk that fails to decompress reads as zeroes, like the end of a truncated plain image.
+  Chunk &load_chunk(uint32_t index) {
+    auto lru = &m_chunks[0];
+
+    for (auto &chunk : m_chunks) {
+      if (chunk.index == index) {
+        chunk.last_used = ++m_clock;
+        return chunk;
+      }
+
+      if (chunk.last_used < lru->last_used)
+        lru = &chunk;
+    }
+
+    auto size = (size_t)std::min<uint64_t>(m_chunk_size, (uint64_t)m_block_count * block_size - (uint64_t)index * m_chunk_size);
+    auto stored_size = m_offsets[index + 1] - m_offsets[index];
+
+    lru->index = index;
+    lru->last_used = ++m_clock;
+    lru->data.resize(m_chunk_size);
+
+    if (stored_size == 0) {
+      std::fill(lru->data.begin(), lru->data.end(), 0);
+      return *lru;
+    }
+
+    if (stored_size == size) {
+      if (pread(m_fd, lru->data.data(), size, m_offsets[index]) != (ssize_t)size)
+        std::fill(lru->data.begin(), lru->data.end(), 0);
+      return *lru;
+    }
+
+    m_compressed.resize(stored_size);
+    if (pread(m_fd, m_compressed.data(), stored_size, m_offsets[index]) != (ssize_t)stored_size ||
+        !lz_decompress(m_compressed.data(), stored_size, lru->data.data(), size))
+      std::fill(lru->data.begin(), lru->data.end(), 0);
+
+    return *lru;
+  }
+
+  int m_fd;
+  uint32_t m_chunk_size;
+  uint32_t m_block_count;
+  std::vector<uint64_t> m_offsets;
+
+  std::vector<Chunk> m_chunks;
+  std::vector<uint8_t> m_compressed;
+  uint64_t m_clock = 0;
+};
+
+// Compressed images are opened as they are; unless they're wanted read-only, they get an overlay
+// next to them to take the writes.
+inline std::unique_ptr<DiskImage> open_disk_image(const std::filesystem::path &path, const DiskOptions &options) {
+  if (CompressedDiskImage::is_compressed(path)) {
+    auto image = std::make_unique<CompressedDiskImage>(path);
+    if (options.read_only)
+      return image;
+
+    auto overlay_path = path;
+    overlay_path += ".overlay";
+
+    return std::make_unique<OverlayDiskImage>(std::move(image), overlay_path, options.sync);
+  }
+
+  if (options.backend == DISK_BACKEND_MMAP)
+    return std::make_unique<MappedDiskImage>(path, options.sync, options.read_only);
+  if (options.backend == DISK_BACKEND_SPARSE)
+    return std::make_unique<SparseDiskImage>(path, options.sync, options.read_only);
+
+  return std::make_unique<FileDiskImage>(path, options.sync, options.read_only);
+}
+
+// Opens `path` read-only underneath a copy-on-write overlay at `overlay_path`, creating the overlay
+// if it doesn't exist yet.
+inline std::unique_ptr<OverlayDiskImage> open_overlay_image(const std::filesystem::path &path, const std::filesystem::path &overlay_path,
+                                                            DiskOptions options) {
+  options.read_only = true;
+
+  return std::make_unique<OverlayDiskImage>(open_disk_image(path, options), overlay_path, options.sync);
+}
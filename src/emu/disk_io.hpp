@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs disk transfers on a thread of its own so the CPU keeps going while the host does the I/O.
+// The disk controller only ever has one transfer in flight, so a single thread is all it takes.
+class DiskIoWorker {
+public:
+  DiskIoWorker() {
+    m_thread = std::thread([this] { run(); });
+  }
+
+  ~DiskIoWorker() {
+    {
+      std::lock_guard lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_wake.notify_all();
+    m_thread.join();
+  }
+
+  DiskIoWorker(const DiskIoWorker &) = delete;
+  DiskIoWorker &operator=(const DiskIoWorker &) = delete;
+
+  // Only call this when `busy()` is false.
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard lock(m_mutex);
+      m_job = std::move(job);
+      m_busy = true;
+    }
+
+    m_wake.notify_all();
+  }
+
+  bool busy() {
+    std::lock_guard lock(m_mutex);
+    return m_busy;
+  }
+
+  void wait() {
+    std::unique_lock lock(m_mutex);
+    m_wake.wait(lock, [this] { return !m_busy; });
+  }
+
+private:
+  void run() {
+    std::unique_lock lock(m_mutex);
+
+    while (true) {
+      // A transfer that's already queued still goes through; a write may depend on it.
+      m_wake.wait(lock, [this] { return m_stopping || m_job; });
+      if (!m_job)
+        return;
+
+      auto job = std::move(m_job);
+      m_job = nullptr;
+
+      lock.unlock();
+      job();
+      lock.lock();
+
+      m_busy = false;
+      m_wake.notify_all();
+    }
+  }
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+
+  std::function<void()> m_job;
+  bool m_busy = false;
+  bool m_stopping = false;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+// A boot profile: the blocks a run read from a disk, in the order it first read them. Guests
+// read much the same blocks every time they boot, so the next run can fetch them ahead of time.
+struct DiskProfileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_count; // Of the image it was recorded on
+  uint32_t count;
+};
+
+constexpr static char disk_profile_magic[8] = {'L', 'S', 'D', 'P', 'R', 'O', 'F', 'L'};
+constexpr static uint32_t disk_profile_version = 1;
+
+// Caps a profile at 32MiB worth of blocks, both when recording and when loading one.
+constexpr static uint32_t max_disk_profile_blocks = 65536;
+
+// A missing, damaged or mismatched profile just means nothing to prefetch.
+inline std::vector<uint32_t> load_disk_profile(const std::filesystem::path &path, uint32_t block_count) {
+  auto stream = std::ifstream(path, std::ios::binary);
+  DiskProfileHeader header;
+
+  if (!stream.read((char *)&header, sizeof(header)) || memcmp(header.magic, disk_profile_magic, sizeof(disk_profile_magic)))
+    return {};
+  if (header.version != disk_profile_version || header.block_count != block_count)
+    return {};
+
+  // Checked before allocating anything, so a damaged count can't ask for gigabytes.
+  std::error_code error;
+  auto file_size = std::filesystem::file_size(path, error);
+  if (error || header.count > max_disk_profile_blocks || header.count > (file_size - sizeof(header)) / sizeof(uint32_t))
+    return {};
+
+  std::vector<uint32_t> blocks(header.count);
+  if (!stream.read((char *)blocks.data(), blocks.size() * sizeof(uint32_t)))
+    return {};
+
+  return blocks;
+}
+
+// Written next to the old profile and renamed over it, so a reader never sees half of one.
+inline bool save_disk_profile(const std::filesystem::path &path, uint32_t block_count, const std::vector<uint32_t> &blocks) {
+  auto temp_path = path;
+  temp_path += ".tmp";
+
+  {
+    auto stream = std::ofstream(temp_path, std::ios::binary | std::ios::trunc);
+
+    DiskProfileHeader header = {{}, disk_profile_version, block_count, (uint32_t)blocks.size()};
+    memcpy(header.magic, disk_profile_magic, sizeof(disk_profile_magic));
+
+    stream.write((const char *)&header, sizeof(header));
+    stream.write((const char *)blocks.data(), blocks.size() * sizeof(uint32_t));
+
+    if (!stream.flush())
+      return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+
+  return !error;
+}
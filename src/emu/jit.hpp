@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+
+#define LS_EMU_HAS_JIT 1
+#endif
+
+enum X86Reg : uint8_t {
+  X86_EAX = 0,
+  X86_ECX = 1,
+  X86_EDX = 2,
+  X86_EBX = 3,
+  X86_ESP = 4,
+  X86_EBP = 5,
+  X86_ESI = 6,
+  X86_EDI = 7,
+  X86_R12 = 12,
+  X86_R13 = 13,
+  X86_R14 = 14,
+};
+
+enum X86AluOp : uint8_t {
+  X86_ADD = 0x03,
+  X86_OR = 0x0b,
+  X86_AND = 0x23,
+  X86_SUB = 0x2b,
+  X86_XOR = 0x33,
+  X86_CMP = 0x3b,
+};
+
+enum X86Cond : uint8_t {
+  X86_COND_B = 0x2,
+  X86_COND_E = 0x4,
+  X86_COND_NE = 0x5,
+  X86_COND_L = 0xc,
+};
+
+// Executable memory for translated blocks. Space is only ever handed out, never returned: a
+// block dropped because its page was written to leaves its code behind as garbage, and that is
+// only reclaimed when the arena runs out and the owner drops every translation and calls `reset`.
+class JitArena {
+public:
+  constexpr static size_t arena_size = 32 * 1024 * 1024;
+
+  JitArena() {
+#ifdef LS_EMU_HAS_JIT
+    auto memory = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+      throw std::runtime_error("Failed to allocate JIT arena");
+
+    m_memory = (uint8_t *)memory;
+#endif
+  }
+
+  ~JitArena() {
+#ifdef LS_EMU_HAS_JIT
+    munmap(m_memory, arena_size);
+#endif
+  }
+
+  JitArena(const JitArena &) = delete;
+  JitArena &operator=(const JitArena &) = delete;
+
+  uint8_t *allocate(size_t size) {
+    if (m_used + size > arena_size)
+      return nullptr;
+
+    auto code = m_memory + m_used;
+    m_used += (size + 15) & ~15;
+    return code;
+  }
+
+  void reset() {
+    m_used = 0;
+  }
+
+private:
+  uint8_t *m_memory = nullptr;
+  size_t m_used = 0;
+};
+
+// Just enough of an x86-64 assembler for the block translator in `Cpu`. Memory operands
+// are always 32-bit displacements off a base register, which keeps every encoding fixed-size.
+class X86Emitter {
+public:
+  void push(X86Reg reg) {
+    rex(false, 0, reg);
+    byte(0x50 + (reg & 7));
+  }
+
+  void pop(X86Reg reg) {
+    rex(false, 0, reg);
+    byte(0x58 + (reg & 7));
+  }
+
+  void mov_reg64(X86Reg dst, X86Reg src) {
+    rex(true, src, dst);
+    byte(0x89);
+    byte(0xc0 | (src & 7) << 3 | (dst & 7));
+  }
+
+  void mov_reg32(X86Reg dst, X86Reg src) {
+    rex(false, src, dst);
+    byte(0x89);
+    byte(0xc0 | (src & 7) << 3 | (dst & 7));
+  }
+
+  void mov_imm32(X86Reg dst, uint32_t imm) {
+    rex(false, 0, dst);
+    byte(0xb8 + (dst & 7));
+    dword(imm);
+  }
+
+  void mov_imm64(X86Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xb8 + (dst & 7));
+    dword(imm);
+    dword(imm >> 32);
+  }
+
+  void load32(X86Reg dst, X86Reg base, int32_t disp) {
+    rex(false, dst, base);
+    byte(0x8b);
+    mem(dst, base, disp);
+  }
+
+  void store32(X86Reg base, int32_t disp, X86Reg src) {
+    rex(false, src, base);
+    byte(0x89);
+    mem(src, base, disp);
+  }
+
+  void lea32(X86Reg dst, X86Reg base, int32_t disp) {
+    rex(false, dst, base);
+    byte(0x8d);
+    mem(dst, base, disp);
+  }
+
+  void alu_mem(X86AluOp op, X86Reg dst, X86Reg base, int32_t disp) {
+    rex(false, dst, base);
+    byte(op);
+    mem(dst, base, disp);
+  }
+
+  // The `/digit` of the 0x81 group is the register-form opcode shifted down by 3.
+  void alu_imm(X86AluOp op, X86Reg dst, uint32_t imm) {
+    rex(false, 0, dst);
+    byte(0x81);
+    byte(0xc0 | (op >> 3) << 3 | (dst & 7));
+    dword(imm);
+  }
+
+  void cmp_mem_zero(X86Reg base, int32_t disp) {
+    rex(false, 0, base);
+    byte(0x83);
+    mem(X86Reg(7), base, disp);
+    byte(0);
+  }
+
+  void imul_mem(X86Reg dst, X86Reg base, int32_t disp) {
+    rex(false, dst, base);
+    byte(0x0f);
+    byte(0xaf);
+    mem(dst, base, disp);
+  }
+
+  void not32(X86Reg reg) {
+    rex(false, 0, reg);
+    byte(0xf7);
+    byte(0xd0 | (reg & 7));
+  }
+
+  void setcc_zext(X86Cond cond, X86Reg reg) {
+    byte(0x0f);
+    byte(0x90 | cond);
+    byte(0xc0 | (reg & 7));
+    byte(0x0f);
+    byte(0xb6);
+    byte(0xc0 | (reg & 7) << 3 | (reg & 7));
+  }
+
+  void cmov(X86Cond cond, X86Reg dst, X86Reg src) {
+    rex(false, dst, src);
+    byte(0x0f);
+    byte(0x40 | cond);
+    byte(0xc0 | (dst & 7) << 3 | (src & 7));
+  }
+
+  void test8(X86Reg reg) {
+    byte(0x84);
+    byte(0xc0 | (reg & 7) << 3 | (reg & 7));
+  }
+
+  void call(X86Reg reg) {
+    rex(false, 0, reg);
+    byte(0xff);
+    byte(0xd0 | (reg & 7));
+  }
+
+  void add_rsp(int8_t imm) {
+    byte(0x48);
+    byte(0x83);
+    byte(0xc4);
+    byte(imm);
+  }
+
+  void ret() {
+    byte(0xc3);
+  }
+
+  // Emits a `jnz` skipping the next `length` bytes.
+  void jnz_short(uint8_t length) {
+    byte(0x75);
+    byte(length);
+  }
+
+  // Emits a `jmp rel32` whose target is filled in by `patch_jump`.
+  size_t jmp_forward() {
+    byte(0xe9);
+    dword(0);
+    return m_code.size();
+  }
+
+  void patch_jump(size_t from, size_t to) {
+    auto rel = (uint32_t)(to - from);
+    memcpy(&m_code[from - 4], &rel, 4);
+  }
+
+  size_t size() const {
+    return m_code.size();
+  }
+
+  const uint8_t *data() const {
+    return m_code.data();
+  }
+
+private:
+  void rex(bool wide, uint8_t reg, uint8_t rm) {
+    uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+    if (prefix != 0x40)
+      byte(prefix);
+  }
+
+  void mem(uint8_t reg, uint8_t base, int32_t disp) {
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == X86_ESP)
+      byte(0x24);
+    dword(disp);
+  }
+
+  void byte(uint8_t value) {
+    m_code.push_back(value);
+  }
+
+  void dword(uint32_t value) {
+    for (auto i = 0; i < 4; i++)
+      byte(value >> (i * 8));
+  }
+
+  std::vector<uint8_t> m_code;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define LS_EMU_HAS_SIMD_CONVERT 1
+#endif
+
+// Kinnow pixels are 5:5:5 with red in the low bits. Each channel widens to 8 bits as
+// c * 255 / 31 rounded down, which for 0 <= c < 32 is exactly (c * 2106) >> 8 and fits in
+// 16 bits, so the vector kernels need one multiply and one shift per channel. The top bit is
+// ignored and alpha is left at 0.
+inline uint32_t kinnow_to_argb(uint16_t pixel) {
+  uint32_t r = ((pixel & 31) * 2106) >> 8;
+  uint32_t g = (((pixel >> 5) & 31) * 2106) >> 8;
+  uint32_t b = (((pixel >> 10) & 31) * 2106) >> 8;
+
+  return r << 16 | g << 8 | b;
+}
+
+inline void kinnow_convert_scalar(uint32_t *dst, const uint16_t *src, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    dst[i] = kinnow_to_argb(src[i]);
+}
+
+#ifdef LS_EMU_HAS_SIMD_CONVERT
+inline void kinnow_convert_sse2(uint32_t *dst, const uint16_t *src, size_t count) {
+  auto mask = _mm_set1_epi16(31);
+  auto scale = _mm_set1_epi16(2106);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    auto pixels = _mm_loadu_si128((const __m128i *)(src + i));
+
+    auto r = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(pixels, mask), scale), 8);
+    auto g = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(pixels, 5), mask), scale), 8);
+    auto b = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(pixels, 10), mask), scale), 8);
+
+    // Low half of each output is green:blue, high half is alpha (0):red.
+    auto gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(gb, r));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(gb, r));
+  }
+
+  kinnow_convert_scalar(dst + i, src + i, count - i);
+}
+
+[[gnu::target("avx2")]] inline void kinnow_convert_avx2(uint32_t *dst, const uint16_t *src, size_t count) {
+  auto mask = _mm256_set1_epi16(31);
+  auto scale = _mm256_set1_epi16(2106);
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    auto pixels = _mm256_loadu_si256((const __m256i *)(src + i));
+
+    auto r = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(pixels, mask), scale), 8);
+    auto g = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(pixels, 5), mask), scale), 8);
+    auto b = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(pixels, 10), mask), scale), 8);
+
+    auto gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+
+    // The unpacks work within each 128-bit lane, so the halves have to be put back in order.
+    auto low = _mm256_unpacklo_epi16(gb, r);
+    auto high = _mm256_unpackhi_epi16(gb, r);
+
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(low, high, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_permute2x128_si256(low, high, 0x31));
+  }
+
+  kinnow_convert_sse2(dst + i, src + i, count - i);
+}
+#endif
+
+using KinnowConvert = void (*)(uint32_t *dst, const uint16_t *src, size_t count);
+
+// Picks the widest kernel the host supports. SSE2 is part of x86-64, so only AVX2 needs checking.
+inline KinnowConvert kinnow_select_convert() {
+#ifdef LS_EMU_HAS_SIMD_CONVERT
+  if (__builtin_cpu_supports("avx2"))
+    return kinnow_convert_avx2;
+
+  return kinnow_convert_sse2;
+#else
+  return kinnow_convert_scalar;
+#endif
+}
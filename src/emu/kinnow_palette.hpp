@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+// The original lookup table for Kinnow pixels, no longer used to draw. It is kept as the
+// reference the conversion kernels in kinnow_convert.hpp are tested against.
 static uint32_t kinnow_palette[32768] = {
     0,        524288,   1048576,  1572864,  2097152,  2686976,  3211264,  3735552,  4259840,  4849664,  5373952,  5898240,  6422528,  6946816,
     7536640,  8060928,  8585216,  9109504,  9699328,  10223616, 10747904, 11272192, 11796480, 12386304, 12910592, 13434880, 13959168, 14548992,
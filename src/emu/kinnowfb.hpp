@@ -1,14 +1,12 @@
 #pragma once
 
-#include <SDL2/SDL.h>
-
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <memory>
 #include <vector>
 
 #include "bus.hpp"
-#include "kinnow_palette.hpp"
 
 enum KinnowFbRegisters : uint8_t {
   KINNOW_REG_SIZE = 0,
@@ -18,13 +16,25 @@ enum KinnowFbRegisters : uint8_t {
   KINNOW_REG_CAUSE = 7,
 };
 
-class KinnowFb : public Area {
+// A damaged area of the framebuffer, in pixels.
+struct FbRect {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+class KinnowFb final : public Area {
 public:
   KinnowFb(Bus &bus, int width, int height) : m_width(width), m_height(height) {
     auto self = std::shared_ptr<KinnowFb>(this, [](auto) {});
 
     m_framebuffer.resize(width * height * 2, 0);
-    m_pixels.resize(width * height * 4, 0);
+
+    // Everything starts out dirty so the first frame uploads the whole screen.
+    m_dirty_left.resize(height);
+    m_dirty_right.resize(height);
+    mark_all_dirty();
 
     m_slot_info[0] = 0x0c007Ca1;
     m_slot_info[1] = 0x4b494e35;
@@ -37,18 +47,50 @@ public:
     bus.map(24, self);
   }
 
-  // TODO: Implement double buffering/dirty regions?
-  void draw(SDL_Texture *texture) {
-    auto pixels = (uint32_t *)m_pixels.data();
-    auto framebuffer = (uint16_t *)m_framebuffer.data();
+  int width() const {
+    return m_width;
+  }
 
-    for (int y = 0; y < m_height; y++) {
-      for (int x = 0; x < m_width; x++) {
-        pixels[y * m_width + x] = kinnow_palette[framebuffer[y * m_width + x] & 0x7fff];
+  int height() const {
+    return m_height;
+  }
+
+  // Returns the areas of VRAM written since the last call. Nothing calls this when there's no
+  // display, so headless runs never pay for it.
+  const std::vector<FbRect> &damage() {
+    m_damage.clear();
+
+    for (int y = m_dirty_top; y < m_dirty_bottom; y++) {
+      int left = m_dirty_left[y];
+      int right = m_dirty_right[y];
+      if (left >= right)
+        continue;
+
+      m_dirty_left[y] = m_width;
+      m_dirty_right[y] = 0;
+
+      // Consecutive dirty lines are merged, so a blinking cursor is one small rectangle.
+      if (!m_damage.empty() && m_damage.back().y + m_damage.back().height == y) {
+        auto &rect = m_damage.back();
+        auto rect_right = std::max(rect.x + rect.width, right);
+
+        rect.x = std::min(rect.x, left);
+        rect.width = rect_right - rect.x;
+        rect.height++;
+      } else {
+        m_damage.push_back({left, y, right - left, 1});
       }
     }
 
-    SDL_UpdateTexture(texture, nullptr, pixels, m_width * 4);
+    m_dirty_top = m_height;
+    m_dirty_bottom = 0;
+
+    return m_damage;
+  }
+
+  // The guest's 5:5:5 pixels (red in the low bits), `width()` pixels per row.
+  const uint16_t *vram() const {
+    return (const uint16_t *)m_framebuffer.data();
   }
 
   virtual bool mem_read(uint32_t addr, BusSize size, uint32_t &value) {
@@ -111,9 +153,6 @@ public:
       if (addr >= m_framebuffer.size())
         return false;
 
-      auto pixel = addr / 2;
-      auto offset = pixel % m_width;
-      auto line = pixel / m_height;
       auto vram = m_framebuffer.data() + addr;
 
       if (size == BUS_BYTE)
@@ -123,6 +162,11 @@ public:
       else if (size == BUS_LONG)
         *(uint32_t *)vram = value;
 
+      // A long write covers two pixels, which may sit on different lines.
+      mark_dirty(addr / 2);
+      if (size == BUS_LONG)
+        mark_dirty(addr / 2 + 1);
+
       return true;
     }
 
@@ -130,11 +174,41 @@ public:
   }
 
 private:
+  void mark_all_dirty() {
+    std::fill(m_dirty_left.begin(), m_dirty_left.end(), 0);
+    std::fill(m_dirty_right.begin(), m_dirty_right.end(), m_width);
+
+    m_dirty_top = 0;
+    m_dirty_bottom = m_height;
+  }
+
+  void mark_dirty(uint32_t pixel) {
+    int line = pixel / m_width;
+    int column = pixel % m_width;
+
+    if (line >= m_height)
+      return;
+
+    m_dirty_left[line] = std::min<int>(m_dirty_left[line], column);
+    m_dirty_right[line] = std::max<int>(m_dirty_right[line], column + 1);
+
+    m_dirty_top = std::min(m_dirty_top, line);
+    m_dirty_bottom = std::max(m_dirty_bottom, line + 1);
+  }
+
   int m_width;
   int m_height;
 
   std::vector<uint8_t> m_framebuffer;
-  std::vector<uint8_t> m_pixels;
+
+  // Per line, the dirty columns are [left, right); a clean line has left >= right. Top and
+  // bottom bound the dirty lines, so an idle screen costs nothing to check.
+  std::vector<uint16_t> m_dirty_left;
+  std::vector<uint16_t> m_dirty_right;
+  int m_dirty_top;
+  int m_dirty_bottom;
+
+  std::vector<FbRect> m_damage;
 
   uint32_t m_slot_info[64];
   uint32_t m_regs[64];
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A small LZ77 codec along the lines of LZ4, for compressed disk images: fast to decode, and
+// good enough on disk images, which are mostly zeroes, text and code.
+//
+// The stream is a run of sequences. Each starts with a token whose high nibble is the literal
+// count and low nibble the match length minus 4; a nibble of 15 continues in the bytes after it,
+// each adding up to 255. Next come the literals, then the match offset as 16 bits little-endian,
+// then the rest of the match length. The last sequence stops after its literals.
+constexpr static uint32_t lz_min_match = 4;
+constexpr static uint32_t lz_max_offset = 65535;
+constexpr static uint32_t lz_hash_bits = 14;
+
+inline void lz_put_length(std::vector<uint8_t> &out, size_t length) {
+  for (; length >= 255; length -= 255)
+    out.push_back(255);
+
+  out.push_back(length);
+}
+
+inline void lz_put_sequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t literal_count, size_t match_length, size_t offset) {
+  auto match = match_length ? match_length - lz_min_match : 0;
+
+  out.push_back(std::min<size_t>(literal_count, 15) << 4 | std::min<size_t>(match, 15));
+  if (literal_count >= 15)
+    lz_put_length(out, literal_count - 15);
+
+  out.insert(out.end(), literals, literals + literal_count);
+
+  if (!match_length)
+    return;
+
+  out.push_back(offset & 0xff);
+  out.push_back(offset >> 8);
+  if (match >= 15)
+    lz_put_length(out, match - 15);
+}
+
+// Greedy matching against the last position seen for each hash of 4 bytes. Stretches without
+// matches are skipped through faster and faster, so incompressible data doesn't take forever.
+inline std::vector<uint8_t> lz_compress(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> out;
+  std::vector<uint32_t> table(1 << lz_hash_bits, UINT32_MAX);
+
+  auto read32 = [&](size_t at) {
+    uint32_t value;
+    memcpy(&value, data + at, sizeof(value));
+    return value;
+  };
+
+  size_t anchor = 0;
+  size_t pos = 0;
+
+  while (pos + lz_min_match <= size) {
+    auto value = read32(pos);
+    auto &slot = table[(value * 2654435761u) >> (32 - lz_hash_bits)];
+    auto candidate = slot;
+    slot = pos;
+
+    if (candidate == UINT32_MAX || pos - candidate > lz_max_offset || read32(candidate) != value) {
+      pos += 1 + ((pos - anchor) >> 6);
+      continue;
+    }
+
+    auto length = lz_min_match;
+    while (pos + length < size && data[candidate + length] == data[pos + length])
+      length++;
+
+    lz_put_sequence(out, data + anchor, pos - anchor, length, pos - candidate);
+
+    pos += length;
+    anchor = pos;
+  }
+
+  lz_put_sequence(out, data + anchor, size - anchor, 0, 0);
+  return out;
+}
+
+// Fails on anything that doesn't decode to exactly `size` bytes, without writing past them.
+inline bool lz_decompress(const uint8_t *in, size_t in_size, uint8_t *out, size_t size) {
+  auto in_end = in + in_size;
+  auto out_start = out;
+  auto out_end = out + size;
+
+  auto get_length = [&](size_t length) -> size_t {
+    if (length != 15)
+      return length;
+
+    while (in < in_end) {
+      auto byte = *in++;
+      length += byte;
+      if (byte != 255)
+        return length;
+    }
+
+    return SIZE_MAX; // Ran out of input
+  };
+
+  while (in < in_end) {
+    auto token = *in++;
+
+    auto literal_count = get_length(token >> 4);
+    if (literal_count > (size_t)(in_end - in) || literal_count > (size_t)(out_end - out))
+      return false;
+
+    memcpy(out, in, literal_count);
+    in += literal_count;
+    out += literal_count;
+
+    if (in == in_end)
+      break;
+
+    if (in_end - in < 2)
+      return false;
+
+    size_t offset = in[0] | in[1] << 8;
+    in += 2;
+
+    auto match_length = get_length(token & 0xf);
+    if (match_length == SIZE_MAX || offset == 0 || offset > (size_t)(out - out_start))
+      return false;
+
+    match_length += lz_min_match;
+    if (match_length > (size_t)(out_end - out))
+      return false;
+
+    // Byte by byte, since a match may overlap the bytes it produces.
+    for (auto match = out - offset; match_length--;)
+      *out++ = *match++;
+  }
+
+  return out == out_end;
+}
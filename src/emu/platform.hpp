@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
@@ -8,7 +9,10 @@
 #include <vector>
 
 #include "bus.hpp"
+#include "disk_image.hpp"
+#include "disk_io.hpp"
 #include "lsic.hpp"
+#include "scheduler.hpp"
 
 enum PlatformMemoryArea : uint8_t {
   PBOARD_CITRON,
@@ -21,6 +25,12 @@ enum PlatformMemoryArea : uint8_t {
   PBOARD_NONE,
 };
 
+enum DiskTransfer : uint8_t {
+  DISK_TRANSFER_READ,
+  DISK_TRANSFER_WRITE,
+  DISK_TRANSFER_DISCARD,
+};
+
 struct PlatformArea {
   PlatformMemoryArea area;
   uint32_t address;
@@ -40,48 +50,50 @@ public:
   }
 };
 
-class DiskController : public CitronPort {
-  struct AttachedDisk {
-    AttachedDisk(std::filesystem::path disk_path) : stream(disk_path, std::ios::binary | std::ios::in | std::ios::out | std::ios::app) {
-      if (!stream.good())
-        throw std::runtime_error("Failed to open disk image");
+class DiskController final : public CitronPort {
+  // How often an outstanding transfer is checked on, in guest time.
+  constexpr static uint64_t completion_poll_us = 100;
 
-      stream.seekg(0, std::ios::end);
-
-      block_count = stream.tellg() / 512;
-    }
-
-    std::fstream stream;
-
-    uint32_t block_count;
-  };
+  // Largest DMA transfer, in blocks, which bounds the staging buffer.
+  constexpr static uint32_t max_dma_blocks = 256;
 
   friend class Platform;
 
 public:
-  DiskController() {
+  DiskController(Bus &bus, InterruptController &int_ctl, Scheduler &scheduler) : m_bus(bus), m_int_ctl(int_ctl), m_scheduler(scheduler) {
     m_disk_buffer.resize(512, 0);
     m_disks.clear();
   }
 
-  void attach(std::filesystem::path disk_path) {
+  // A queued transfer still runs when the worker shuts down, and it uses the transfer members
+  // declared after `m_io`, which would be gone by then.
+  ~DiskController() {
+    m_io.wait();
+  }
+
+  void attach(std::unique_ptr<DiskImage> disk) {
     if (m_disks.size() >= 8)
       throw std::runtime_error("Reached the maximum amount of disks attached");
 
-    m_disks.emplace_back(disk_path);
+    m_disks.push_back(std::move(disk));
   }
 
   void reset() override {
     m_interrupts = false;
+    settle();
+
     m_port_a = 0;
     m_port_b = 0;
     m_selected = 0;
     m_info_what = 0;
     m_info_details = 0;
     m_operation = 0;
+    m_dma_address = 0;
   }
 
   bool read(InterruptController &int_ctl, uint32_t port, BusSize size, uint32_t &value) override {
+    settle();
+
     if (port == 0x19) { // Command
       value = m_operation;
       return true;
@@ -97,6 +109,8 @@ public:
   }
 
   bool write(InterruptController &int_ctl, uint32_t port, BusSize size, uint32_t value) override {
+    settle();
+
     if (port == 0x19) {
       switch (value) {
       case 1: // Select drive
@@ -109,28 +123,22 @@ public:
         if (m_selected == -1)
           return false;
 
-        auto &disk = m_disks[m_selected];
-        if (m_port_a >= disk.block_count)
+        auto &disk = *m_disks[m_selected];
+        if (m_port_a >= disk.block_count())
           return false;
 
-        disk.stream.seekg(m_port_a * 512, std::ios::beg);
-        disk.stream.read((char *)m_disk_buffer.data(), m_disk_buffer.size());
-
-        write_info(int_ctl, 0, m_port_a);
+        start_transfer(disk, m_port_a, 1, DISK_TRANSFER_READ);
         return true;
       }
       case 3: { // Write block
         if (m_selected == -1)
           return false;
 
-        auto &disk = m_disks[m_selected];
-        if (m_port_a >= disk.block_count)
+        auto &disk = *m_disks[m_selected];
+        if (m_port_a >= disk.block_count())
           return false;
 
-        disk.stream.seekp(m_port_a * 512, std::ios::beg);
-        disk.stream.write((const char *)m_disk_buffer.data(), m_disk_buffer.size());
-
-        write_info(int_ctl, 0, m_port_a);
+        start_transfer(disk, m_port_a, 1, DISK_TRANSFER_WRITE);
         return true;
       }
       case 4: // Read info
@@ -139,7 +147,7 @@ public:
         return true;
       case 5: // Get drive block count
         if (m_port_a < m_disks.size()) {
-          m_port_b = m_disks[m_port_a].block_count;
+          m_port_b = m_disks[m_port_a]->block_count();
           m_port_a = 1;
         } else {
           m_port_a = 0;
@@ -152,6 +160,39 @@ public:
       case 7: // Disable interrupts
         m_interrupts = false;
         return true;
+      case 8: // Set DMA address
+        m_dma_address = m_port_a;
+        return true;
+      case 9:    // DMA read
+      case 10: { // DMA write
+        if (m_selected == -1)
+          return false;
+
+        // Port A is the first block and port B the block count; the whole run moves between the
+        // disk and RAM at the DMA address, with a single completion.
+        auto &disk = *m_disks[m_selected];
+        auto write = value == 10;
+        if (m_port_b == 0 || m_port_b > max_dma_blocks || (uint64_t)m_port_a + m_port_b > disk.block_count())
+          return false;
+        if (!m_bus.host_mapped(m_dma_address, m_port_b * DiskImage::block_size, !write))
+          return false;
+
+        start_transfer(disk, m_port_a, m_port_b, write ? DISK_TRANSFER_WRITE : DISK_TRANSFER_READ, true);
+        return true;
+      }
+      case 11: { // Discard blocks
+        if (m_selected == -1)
+          return false;
+
+        // Port A is the first block and port B the block count. The blocks read as zeroes from
+        // then on, and the host is free to give back the space they took.
+        auto &disk = *m_disks[m_selected];
+        if (m_port_b == 0 || (uint64_t)m_port_a + m_port_b > disk.block_count())
+          return false;
+
+        start_transfer(disk, m_port_a, m_port_b, DISK_TRANSFER_DISCARD);
+        return true;
+      }
       }
 
       return false;
@@ -166,29 +207,135 @@ public:
     return false;
   }
 
+  // Finishes an outstanding transfer right away, for when the guest touches the controller or
+  // its buffer before the completion interrupt arrived.
+  void settle() {
+    if (!m_transfer_pending)
+      return;
+
+    m_io.wait();
+    complete_transfer();
+  }
+
 private:
-  void write_info(InterruptController &int_ctl, uint32_t what, uint32_t details) {
+  // With interrupts off the guest expects the block to be there as soon as the command returns,
+  // so only guests that wait for the completion interrupt get their I/O done in the background.
+  void start_transfer(DiskImage &disk, uint32_t block, uint32_t count, DiskTransfer kind, bool dma = false) {
+    m_transfer_block = block;
+    m_transfer_count = count;
+    m_transfer_kind = kind;
+    m_transfer_dma = dma;
+
+    if (kind != DISK_TRANSFER_DISCARD)
+      m_transfer_buffer.resize(count * DiskImage::block_size);
+
+    // Data to be written is taken now, so the guest is free to reuse its buffer straight away.
+    if (kind == DISK_TRANSFER_WRITE && dma)
+      m_bus.dma_read(m_dma_address, m_transfer_buffer.data(), m_transfer_buffer.size());
+    else if (kind == DISK_TRANSFER_WRITE)
+      m_transfer_buffer = m_disk_buffer;
+
+    if (!m_interrupts) {
+      transfer(disk);
+      m_transfer_pending = true;
+      complete_transfer();
+      return;
+    }
+
+    m_io.submit([this, &disk] { transfer(disk); });
+    m_transfer_pending = true;
+
+    m_completion = m_scheduler.schedule_in(completion_poll_interval(), [this] { poll_transfer(); });
+  }
+
+  // Runs on the I/O thread, which only ever touches the transfer buffer.
+  void transfer(DiskImage &disk) {
+    if (m_transfer_kind == DISK_TRANSFER_DISCARD) {
+      disk.discard_blocks(m_transfer_block, m_transfer_count);
+      return;
+    }
+
+    for (uint32_t i = 0; i < m_transfer_count; i++) {
+      auto data = m_transfer_buffer.data() + i * DiskImage::block_size;
+
+      if (m_transfer_kind == DISK_TRANSFER_WRITE)
+        disk.write_block(m_transfer_block + i, data);
+      else
+        disk.read_block(m_transfer_block + i, data);
+    }
+  }
+
+  void poll_transfer() {
+    if (m_io.busy()) {
+      m_completion = m_scheduler.schedule_in(completion_poll_interval(), [this] { poll_transfer(); });
+      return;
+    }
+
+    m_completion = 0;
+    complete_transfer();
+  }
+
+  void complete_transfer() {
+    m_scheduler.cancel(m_completion);
+    m_completion = 0;
+    m_transfer_pending = false;
+
+    // The range was checked when the transfer started, and RAM never moves.
+    if (m_transfer_kind == DISK_TRANSFER_READ && m_transfer_dma)
+      m_bus.dma_write(m_dma_address, m_transfer_buffer.data(), m_transfer_buffer.size());
+    else if (m_transfer_kind == DISK_TRANSFER_READ)
+      m_disk_buffer = m_transfer_buffer;
+
+    write_info(0, m_transfer_block);
+  }
+
+  uint64_t completion_poll_interval() const {
+    return std::max<uint64_t>(m_scheduler.from_ms(1) * completion_poll_us / 1000, 1);
+  }
+
+  void write_info(uint32_t what, uint32_t details) {
     m_info_what = what;
     m_info_details = details;
 
     if (m_interrupts)
-      int_ctl.raise(0x3);
+      m_int_ctl.raise(0x3);
   }
 
-  std::vector<AttachedDisk> m_disks;
-  std::vector<uint8_t> m_disk_buffer;
+  Bus &m_bus;
+  InterruptController &m_int_ctl;
+  Scheduler &m_scheduler;
 
-  uint32_t m_selected;
-  uint32_t m_info_what;
-  uint32_t m_info_details;
-  uint32_t m_operation;
-  uint32_t m_port_a;
-  uint32_t m_port_b;
+  std::vector<std::unique_ptr<DiskImage>> m_disks;
+  std::vector<uint8_t> m_disk_buffer;
 
-  bool m_interrupts;
+  DiskIoWorker m_io;
+  std::vector<uint8_t> m_transfer_buffer = std::vector<uint8_t>(512);
+  uint32_t m_transfer_block = 0;
+  uint32_t m_transfer_count = 0;
+  DiskTransfer m_transfer_kind = DISK_TRANSFER_READ;
+  bool m_transfer_dma = false;
+  bool m_transfer_pending = false;
+  EventId m_completion = 0;
+
+  uint32_t m_selected = 0;
+  uint32_t m_info_what = 0;
+  uint32_t m_info_details = 0;
+  uint32_t m_operation = 0;
+  uint32_t m_port_a = 0;
+  uint32_t m_port_b = 0;
+  uint32_t m_dma_address = 0;
+
+  bool m_interrupts = false;
 };
 
-class Platform : public Area {
+class Platform final : public Area {
+  struct PortDispatch {
+    CitronPort *port = nullptr;
+
+    bool (*read[3])(CitronPort *port, InterruptController &int_ctl, uint32_t num, uint32_t &value) = {};
+    bool (*write[3])(CitronPort *port, InterruptController &int_ctl, uint32_t num, uint32_t value) = {};
+  };
+
 public:
   Platform(Bus &bus, InterruptController &int_ctl, DiskController &disk_ctl, std::filesystem::path boot_rom)
       : m_int_ctl(int_ctl), m_disk_ctl(disk_ctl) // sorry, OCD.
@@ -211,24 +358,35 @@ public:
       throw std::runtime_error("Failed to open boot ROM image");
     }
 
-    set_port(0x19, disk_ctl.shared_from_this());
-    set_port(0x1a, disk_ctl.shared_from_this());
-    set_port(0x1b, disk_ctl.shared_from_this());
+    auto disk_port = std::static_pointer_cast<DiskController>(disk_ctl.shared_from_this());
+
+    set_port(0x19, disk_port);
+    set_port(0x1a, disk_port);
+    set_port(0x1b, disk_port);
 
     bus.map(31, self);
+    bus.map_host(0xf8001000, m_nvram.size(), m_nvram.data(), true);
+    bus.map_host(0xfffe0000, m_boot_rom.size(), m_boot_rom.data(), false);
   }
 
-  void set_port(uint32_t num, std::shared_ptr<CitronPort> port) {
+  // Like `Bus::map`, the accessors are instantiated for the static type of `port`.
+  template <typename T>
+  void set_port(uint32_t num, std::shared_ptr<T> port) {
     if (m_ports[num] != nullptr)
       throw std::runtime_error("Port already in use");
 
     m_ports[num] = port;
+    m_dispatch[num] = {
+        port.get(),
+        {&dispatch_read<T, BUS_BYTE>, &dispatch_read<T, BUS_INT>, &dispatch_read<T, BUS_LONG>},
+        {&dispatch_write<T, BUS_BYTE>, &dispatch_write<T, BUS_INT>, &dispatch_write<T, BUS_LONG>},
+    };
   }
 
   void reset() override {
     m_int_ctl.reset();
 
-    for (auto port : m_ports) {
+    for (auto &port : m_ports) {
       if (port)
         port->reset();
     }
@@ -240,8 +398,8 @@ public:
     switch (area) {
     case PBOARD_CITRON: {
       auto port_num = address / 4;
-      if (auto port = m_ports[port_num])
-        return port->read(m_int_ctl, port_num, size, value);
+      if (auto &dispatch = m_dispatch[port_num]; dispatch.port)
+        return dispatch.read[size](dispatch.port, m_int_ctl, port_num, value);
 
       value = 0;
       return true;
@@ -268,6 +426,8 @@ public:
       if (address > m_disk_ctl.m_disk_buffer.size())
         return false;
 
+      m_disk_ctl.settle();
+
       auto disk_buf = m_disk_ctl.m_disk_buffer.data() + address;
       if (size == BUS_BYTE)
         value = *(uint8_t *)disk_buf;
@@ -307,8 +467,8 @@ public:
     switch (area) {
     case PBOARD_CITRON: {
       auto port_num = address / 4;
-      if (auto port = m_ports[port_num])
-        return port->write(m_int_ctl, port_num, size, value);
+      if (auto &dispatch = m_dispatch[port_num]; dispatch.port)
+        return dispatch.write[size](dispatch.port, m_int_ctl, port_num, value);
       return true;
     }
     case PBOARD_REGS: {
@@ -333,6 +493,8 @@ public:
       if (address > m_disk_ctl.m_disk_buffer.size())
         return false;
 
+      m_disk_ctl.settle();
+
       auto disk_buf = m_disk_ctl.m_disk_buffer.data() + address;
       if (size == BUS_BYTE)
         *(uint8_t *)disk_buf = value;
@@ -358,7 +520,24 @@ public:
     }
   }
 
+  // Only the boot ROM: it can't be written to, so its blocks never need invalidating.
+  bool can_cache_code(uint32_t addr) override {
+    auto [area, address] = area_from_addr(addr);
+
+    return area == PBOARD_BOOT_ROM && address + 4 <= m_boot_rom.size();
+  }
+
 private:
+  template <typename T, BusSize size>
+  static bool dispatch_read(CitronPort *port, InterruptController &int_ctl, uint32_t num, uint32_t &value) {
+    return static_cast<T *>(port)->read(int_ctl, num, size, value);
+  }
+
+  template <typename T, BusSize size>
+  static bool dispatch_write(CitronPort *port, InterruptController &int_ctl, uint32_t num, uint32_t value) {
+    return static_cast<T *>(port)->write(int_ctl, num, size, value);
+  }
+
   PlatformArea area_from_addr(uint32_t addr) const {
     if (addr < 0x400)
       return {PBOARD_CITRON, addr};
@@ -382,6 +561,7 @@ private:
   DiskController &m_disk_ctl;
 
   std::shared_ptr<CitronPort> m_ports[256] = {nullptr};
+  PortDispatch m_dispatch[256];
   std::vector<uint8_t> m_nvram;
   std::vector<uint8_t> m_boot_rom;
 
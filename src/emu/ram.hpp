@@ -7,7 +7,7 @@
 #include "bus.hpp"
 
 class Ram : public std::enable_shared_from_this<Ram> {
-  class RamArea : public Area {
+  class RamArea final : public Area {
   public:
     RamArea(const std::shared_ptr<Ram> &ram, uint32_t page) : m_ram(ram), m_page(page) {
     }
@@ -41,16 +41,21 @@ class Ram : public std::enable_shared_from_this<Ram> {
       else if (size == BUS_LONG)
         *(uint32_t *)ram = value;
 
+      m_ram->m_bus.code_cache().invalidate(offset);
       return true;
     }
 
+    bool can_cache_code(uint32_t addr) override {
+      return m_page * Area::area_size + addr + 4 <= m_ram->m_memory.size();
+    }
+
   private:
     std::shared_ptr<Ram> m_ram;
 
     uint32_t m_page;
   };
 
-  class RamDescriptor : public Area {
+  class RamDescriptor final : public Area {
   public:
     RamDescriptor(const std::shared_ptr<Ram> &ram) : m_ram(ram) {
     }
@@ -83,7 +88,7 @@ public:
   constexpr static uint32_t slot_count = 8;
   constexpr static uint32_t max_size = slot_size * slot_count;
 
-  Ram(Bus &bus, uint32_t size) {
+  Ram(Bus &bus, uint32_t size) : m_bus(bus) {
     auto self = std::shared_ptr<Ram>(this, [](auto) {});
 
     m_memory.resize(size, 0);
@@ -94,6 +99,8 @@ public:
     if (size > Area::area_size)
       bus.map(1, std::make_shared<RamArea>(self, 1));
 
+    bus.map_host(0, size, m_memory.data(), true);
+
     auto full_slots = size / slot_size;
     auto count = 0;
 
@@ -108,6 +115,8 @@ private:
   friend class RamArea;
   friend class RamDescriptor;
 
+  Bus &m_bus;
+
   std::vector<uint8_t> m_memory;
 
   uint32_t m_slot_sizes[slot_count];
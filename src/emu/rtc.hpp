@@ -3,20 +3,28 @@
 #include <chrono>
 
 #include "platform.hpp"
+#include "scheduler.hpp"
 
-class Rtc : public CitronPort {
+class Rtc final : public CitronPort {
 public:
-  Rtc(Platform &platform) {
+  Rtc(Platform &platform, InterruptController &int_ctl, Scheduler &scheduler) : m_int_ctl(int_ctl), m_scheduler(scheduler) {
     auto self = std::shared_ptr<Rtc>(this, [](auto) {});
 
     platform.set_port(0x20, self);
     platform.set_port(0x21, self);
+
+    m_last_update = scheduler.now();
+    schedule_interrupt();
   }
 
   void reset() override {
+    update();
+
     m_interval_ms = 0;
     m_interval_count = 0;
     m_port_a = 0;
+
+    schedule_interrupt();
   }
 
   bool read(InterruptController &int_ctl, uint32_t port, BusSize size, uint32_t &value) override {
@@ -35,28 +43,28 @@ public:
     if (port == 0x20) {
       switch (value) {
       case 1: // Set interval
+        update();
         m_interval_ms = m_port_a;
         m_interval_count = 0;
+        schedule_interrupt();
         return true;
       case 2: // Get epoch time
-        if (m_modified)
-          m_port_a = m_current_time_sec;
-        else
-          m_port_a = std::chrono::duration_cast<std::chrono::seconds>(m_time.time_since_epoch()).count();
+        update();
+        m_port_a = m_guest_clock ? m_current_time_sec : host_time_ms() / 1000;
         return true;
       case 3: // Get epoch ms
-        if (m_modified)
-          m_port_a = m_current_time_ms;
-        else
-          m_port_a = std::chrono::duration_cast<std::chrono::milliseconds>(m_time.time_since_epoch()).count();
+        update();
+        m_port_a = m_guest_clock ? m_current_time_ms : host_time_ms() % 1000;
         return true;
       case 4: // Set epoch time
+        update();
         m_current_time_sec = m_port_a;
-        m_modified = true;
+        m_guest_clock = true;
         return true;
       case 5: // Set epoch ms
+        update();
         m_current_time_ms = m_port_a;
-        m_modified = true;
+        m_guest_clock = true;
         return true;
       }
     } else if (port == 0x21) {
@@ -67,38 +75,74 @@ public:
     return false;
   }
 
-  void tick(InterruptController &int_ctl, int ms) {
-    if (!m_modified) {
-      m_time = m_clock.now();
-    } else {
-      m_current_time_ms += ms;
+  // Keeps the epoch in guest time from here on, starting at `epoch_ms`, instead of reading the
+  // host clock. Runs on virtual time use this so the guest sees the same dates however fast the
+  // host happens to be.
+  void set_epoch(uint64_t epoch_ms) {
+    update();
 
-      if (m_current_time_ms >= 1000) {
-        m_current_time_ms -= 1000;
-        m_current_time_sec += 1;
-      }
+    m_current_time_sec = epoch_ms / 1000;
+    m_current_time_ms = epoch_ms % 1000;
+    m_guest_clock = true;
+  }
+
+  static uint64_t host_time_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  // How many more milliseconds of `tick` until the interval interrupt fires.
+  uint32_t ms_until_interrupt() const {
+    return m_interval_ms > m_interval_count ? m_interval_ms - m_interval_count : 1;
+  }
+
+  // Catches the clock up with guest time, in whole milliseconds; the remainder carries over.
+  void update() {
+    auto ms = (m_scheduler.now() - m_last_update) / m_scheduler.instructions_per_ms();
+
+    if (ms) {
+      m_last_update += m_scheduler.from_ms(ms);
+      tick(ms);
+    }
+  }
+
+  void schedule_interrupt() {
+    m_scheduler.cancel(m_event);
+    m_event = m_scheduler.schedule_at(m_last_update + m_scheduler.from_ms(ms_until_interrupt()), [this] {
+      update();
+      schedule_interrupt();
+    });
+  }
+
+  // The host clock is only read when the guest asks for the time, not on every tick.
+  void tick(uint32_t ms) {
+    if (m_guest_clock) {
+      m_current_time_ms += ms;
+      m_current_time_sec += m_current_time_ms / 1000;
+      m_current_time_ms %= 1000;
     }
 
     m_interval_count += ms;
 
     if (m_interval_count >= m_interval_ms) {
-      int_ctl.raise(1);
+      m_int_ctl.raise(1);
 
       m_interval_count -= m_interval_ms;
     }
   }
 
-private:
-  using clock = std::chrono::high_resolution_clock;
+  InterruptController &m_int_ctl;
+  Scheduler &m_scheduler;
 
-  bool m_modified = false;
+  EventId m_event = 0;
+  uint64_t m_last_update = 0;
+
+  // Set once the epoch is counted in guest time: the guest set it, or we run on virtual time.
+  bool m_guest_clock = false;
 
   uint32_t m_current_time_sec = 0;
   uint32_t m_current_time_ms = 0;
   uint32_t m_interval_ms = 0;
   uint32_t m_interval_count = 0;
   uint32_t m_port_a = 0;
-
-  clock m_clock;
-  clock::time_point m_time;
 };
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+#include "cpu.hpp"
+
+using EventId = uint64_t;
+
+// Guest time is counted in instructions: what the CPU has retired, plus any idle time skipped
+// while it was halted. Devices schedule callbacks at points in guest time, and the CPU's run
+// deadline always tracks the earliest of them, so it runs uninterrupted up to the next event.
+class Scheduler {
+  struct Event {
+    uint64_t time;
+    EventId id;
+    std::function<void()> callback;
+  };
+
+public:
+  Scheduler(Cpu &cpu, uint64_t instructions_per_second) : m_cpu(cpu), m_instructions_per_ms(instructions_per_second / 1000) {
+  }
+
+  uint64_t now() const {
+    return m_cpu.instructions_retired() + m_skipped;
+  }
+
+  uint64_t instructions_per_ms() const {
+    return m_instructions_per_ms;
+  }
+
+  uint64_t from_ms(uint64_t ms) const {
+    return ms * m_instructions_per_ms;
+  }
+
+  EventId schedule_at(uint64_t time, std::function<void()> callback) {
+    auto id = ++m_last_id;
+
+    m_events.push_back({time, id, std::move(callback)});
+    std::push_heap(m_events.begin(), m_events.end(), later);
+
+    update_deadline();
+    return id;
+  }
+
+  EventId schedule_in(uint64_t delay, std::function<void()> callback) {
+    return schedule_at(now() + delay, std::move(callback));
+  }
+
+  // Cancelled events stay queued until they reach the front; ids are never reused, so that's harmless.
+  void cancel(EventId id) {
+    if (id)
+      m_cancelled.insert(id);
+  }
+
+  // UINT64_MAX when nothing is scheduled.
+  uint64_t next_event() {
+    drop_cancelled();
+
+    return m_events.empty() ? UINT64_MAX : m_events.front().time;
+  }
+
+  // Moves guest time forward to `time` without the CPU running, for when it's halted.
+  void skip_to(uint64_t time) {
+    if (time > now())
+      m_skipped += time - now();
+  }
+
+  // Fires every event that is due, earliest first. Callbacks may schedule further events.
+  void run_due() {
+    while (next_event() <= now()) {
+      std::pop_heap(m_events.begin(), m_events.end(), later);
+
+      auto event = std::move(m_events.back());
+      m_events.pop_back();
+
+      event.callback();
+    }
+
+    update_deadline();
+  }
+
+private:
+  static bool later(const Event &lhs, const Event &rhs) {
+    return lhs.time > rhs.time || (lhs.time == rhs.time && lhs.id > rhs.id);
+  }
+
+  void drop_cancelled() {
+    while (!m_events.empty() && m_cancelled.erase(m_events.front().id)) {
+      std::pop_heap(m_events.begin(), m_events.end(), later);
+      m_events.pop_back();
+    }
+  }
+
+  void update_deadline() {
+    auto next = next_event();
+
+    if (next == UINT64_MAX)
+      m_cpu.clear_deadline();
+    else
+      m_cpu.set_deadline(next > m_skipped ? next - m_skipped : 0);
+  }
+
+  Cpu &m_cpu;
+
+  std::vector<Event> m_events;
+  std::unordered_set<EventId> m_cancelled;
+
+  uint64_t m_instructions_per_ms;
+  uint64_t m_skipped = 0;
+
+  EventId m_last_id = 0;
+};
@@ -3,6 +3,8 @@
 #include <cstdint>
 
 #include "platform.hpp"
+#include "scheduler.hpp"
+#include "serial_backend.hpp"
 
 enum SerialPortCommand : uint8_t {
   SERIAL_CMD_WRITE = 1,
@@ -11,15 +13,19 @@ enum SerialPortCommand : uint8_t {
   SERIAL_CMD_CLEAR_INTERRUPTS,
 };
 
-class SerialPort : public CitronPort {
+class SerialPort final : public CitronPort {
+  constexpr static uint64_t input_poll_ms = 1;
+
 public:
-  SerialPort(Platform &platform, int num) : m_base(0x10 + num * 2) {
+  SerialPort(Platform &platform, InterruptController &int_ctl, Scheduler &scheduler, int num, SerialBackend &backend)
+      : m_base(0x10 + num * 2), m_interrupt_line(4 + num), m_int_ctl(int_ctl), m_scheduler(scheduler), m_backend(backend) {
     auto self = std::shared_ptr<SerialPort>(this, [](auto) {});
 
     platform.set_port(m_base, self);
     platform.set_port(m_base + 1, self);
 
-    setbuf(stdout, nullptr);
+    if (backend.has_input())
+      poll_input();
   }
 
   void reset() override {
@@ -44,11 +50,12 @@ public:
   bool write(InterruptController &int_ctl, uint32_t port, BusSize size, uint32_t value) override {
     if (port == m_base) {
       switch (value) {
-      case SERIAL_CMD_WRITE: putchar(m_data); return true;
-      case SERIAL_CMD_READ:
-        m_data = m_last_data;
-        m_last_data = 0xffff;
+      case SERIAL_CMD_WRITE: m_backend.write(m_data); return true;
+      case SERIAL_CMD_READ: {
+        uint8_t byte;
+        m_data = m_backend.read(byte) ? byte : 0xffff;
         return true;
+      }
       case SERIAL_CMD_SET_INTERRUPTS: m_interrupts = true; return true;
       case SERIAL_CMD_CLEAR_INTERRUPTS: m_interrupts = false; return true;
       }
@@ -66,9 +73,23 @@ public:
   }
 
 private:
+  // Input arrives on another thread, so it's picked up at a fixed rate of guest time. While the
+  // guest leaves anything unread, it keeps getting interrupted.
+  void poll_input() {
+    if (m_interrupts && m_backend.input_pending())
+      m_int_ctl.raise(m_interrupt_line);
+
+    m_scheduler.schedule_in(m_scheduler.from_ms(input_poll_ms), [this] { poll_input(); });
+  }
+
   uint32_t m_base;
+  int m_interrupt_line;
+
+  InterruptController &m_int_ctl;
+  Scheduler &m_scheduler;
+  SerialBackend &m_backend;
+
   uint32_t m_data = 0x0;
-  uint32_t m_last_data = 0xffff;
 
   bool m_interrupts = false;
 };
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "spsc_queue.hpp"
+
+// The host end of a serial port. Everything here is called from the emulation thread.
+class SerialBackend {
+public:
+  virtual ~SerialBackend() = default;
+
+  virtual void write(uint8_t byte) = 0;
+
+  // Whether this backend can ever produce input; ports without any don't bother polling.
+  virtual bool has_input() const {
+    return false;
+  }
+
+  virtual bool input_pending() const {
+    return false;
+  }
+
+  // Takes the next byte of host input, if there is one.
+  virtual bool read(uint8_t &byte) {
+    return false;
+  }
+};
+
+// Serial I/O over file descriptors, with a thread on each side so the guest never makes a
+// syscall. Output goes into a ring buffer that a writer thread flushes whenever a line ends, at
+// least every few milliseconds otherwise, and once more on the way out, including through
+// `exit()` (say, when the guest crashes the CPU), when the last words matter most. Input, if there
+// is an input descriptor, is read as it arrives into a receive FIFO for the port to pick up.
+class FdSerialBackend final : public SerialBackend {
+  constexpr static auto flush_interval = std::chrono::milliseconds(10);
+  constexpr static auto exit_flush_timeout = std::chrono::seconds(1);
+  constexpr static int input_poll_ms = 50;
+
+public:
+  // `input_fd` may be -1 for output only. Both descriptors are closed at the end if `owned` is set.
+  FdSerialBackend(int output_fd, int input_fd, bool owned) : m_output_fd(output_fd), m_input_fd(input_fd), m_owned(owned) {
+    m_writer = std::thread([this] { drain(); });
+
+    if (input_fd >= 0)
+      m_reader = std::thread([this] { fill(); });
+
+    std::lock_guard lock(live_mutex);
+    if (!exit_hook_added) {
+      std::atexit(flush_all);
+      exit_hook_added = true;
+    }
+
+    live.push_back(this);
+  }
+
+  ~FdSerialBackend() {
+    {
+      std::lock_guard lock(live_mutex);
+      std::erase(live, this);
+    }
+
+    m_stopping = true;
+    m_wake.notify_one();
+    m_writer.join();
+
+    if (m_reader.joinable())
+      m_reader.join();
+
+    if (m_owned) {
+      close(m_output_fd);
+      if (m_input_fd >= 0 && m_input_fd != m_output_fd)
+        close(m_input_fd);
+    }
+  }
+
+  bool has_input() const override {
+    return m_input_fd >= 0;
+  }
+
+  bool input_pending() const override {
+    return !m_input.empty();
+  }
+
+  bool read(uint8_t &byte) override {
+    return m_input.pop(byte);
+  }
+
+  void write(uint8_t byte) override {
+    // The guest is outrunning the host; it has to wait, like it would for a real UART.
+    while (!m_buffer.push(byte)) {
+      m_wake.notify_one();
+      std::this_thread::yield();
+    }
+
+    // No lock here: if the writer misses this, it still flushes on its next timeout.
+    if (byte == '\n') {
+      m_line_ended = true;
+      m_wake.notify_one();
+    }
+  }
+
+private:
+  // Runs at `exit()`. Destructors don't run there, so each writer is asked to flush and waited
+  // for, up to a point; a descriptor nobody reads from mustn't keep the process alive.
+  static void flush_all() {
+    std::lock_guard lock(live_mutex);
+
+    for (auto backend : live)
+      backend->flush(exit_flush_timeout);
+  }
+
+  // Everything written before this call is out once it returns true.
+  bool flush(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(m_mutex);
+
+    auto request = ++m_flush_requests;
+    m_line_ended = true;
+    m_wake.notify_all();
+
+    return m_wake.wait_for(lock, timeout, [&] { return m_flushes_done >= request; });
+  }
+
+  void drain() {
+    uint8_t chunk[4096];
+
+    while (true) {
+      uint64_t requests;
+
+      {
+        std::unique_lock lock(m_mutex);
+        m_wake.wait_for(lock, flush_interval, [this] { return m_line_ended || m_stopping; });
+        m_line_ended = false;
+        requests = m_flush_requests;
+      }
+
+      auto stopping = m_stopping.load();
+
+      while (auto count = m_buffer.pop(chunk, sizeof(chunk)))
+        write_all(chunk, count);
+
+      {
+        std::lock_guard lock(m_mutex);
+        m_flushes_done = requests;
+      }
+      m_wake.notify_all();
+
+      if (stopping)
+        return;
+    }
+  }
+
+  // A full FIFO simply stops the reader, which pushes back on whatever is sending.
+  void fill() {
+    uint8_t chunk[256];
+
+    while (!m_stopping) {
+      pollfd poll_fd = {m_input_fd, POLLIN, 0};
+      if (poll(&poll_fd, 1, input_poll_ms) <= 0)
+        continue;
+
+      // A pty nobody has opened yet hangs up until someone does.
+      if (!(poll_fd.revents & POLLIN)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(input_poll_ms));
+        continue;
+      }
+
+      auto count = ::read(m_input_fd, chunk, sizeof(chunk));
+      if (count == 0)
+        return; // End of file, or the socket closed
+      if (count < 0) {
+        if (errno != EINTR && errno != EAGAIN)
+          std::this_thread::sleep_for(std::chrono::milliseconds(input_poll_ms));
+        continue;
+      }
+
+      for (ssize_t i = 0; i < count && !m_stopping; i++) {
+        while (!m_input.push(chunk[i]) && !m_stopping)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  // Gives up on errors (say, a socket whose other end went away) rather than stall the guest.
+  void write_all(const uint8_t *data, size_t size) {
+    while (size) {
+      auto written = ::write(m_output_fd, data, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return;
+
+      data += written;
+      size -= written;
+    }
+  }
+
+  SpscQueue<uint8_t, 65536> m_buffer;
+  SpscQueue<uint8_t, 4096> m_input;
+
+  int m_output_fd;
+  int m_input_fd;
+  bool m_owned;
+
+  std::thread m_writer;
+  std::thread m_reader;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+
+  std::atomic<bool> m_line_ended = false;
+  std::atomic<bool> m_stopping = false;
+  uint64_t m_flush_requests = 0; // Guarded by `m_mutex`, as is the count below
+  uint64_t m_flushes_done = 0;
+
+  static inline std::mutex live_mutex;
+  static inline std::vector<FdSerialBackend *> live;
+  static inline bool exit_hook_added = false;
+};
+
+// Opens a serial backend from a command-line spec: `stdout`, `stdio` (stdout plus stdin for
+// input), `file:PATH` (output only), `unix:PATH` (connects to a listening socket) or `pty`
+// (creates a pseudo-terminal and prints its name).
+inline std::shared_ptr<SerialBackend> open_serial_backend(const std::string &spec) {
+  if (spec == "stdout")
+    return std::make_shared<FdSerialBackend>(STDOUT_FILENO, -1, false);
+
+  if (spec == "stdio")
+    return std::make_shared<FdSerialBackend>(STDOUT_FILENO, STDIN_FILENO, false);
+
+  if (spec.rfind("file:", 0) == 0) {
+    auto fd = open(spec.c_str() + 5, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open serial output file");
+
+    return std::make_shared<FdSerialBackend>(fd, -1, true);
+  }
+
+  if (spec.rfind("unix:", 0) == 0) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (spec.size() - 5 >= sizeof(address.sun_path))
+      throw std::runtime_error("Serial socket path is too long");
+
+    strcpy(address.sun_path, spec.c_str() + 5);
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+      if (fd >= 0)
+        close(fd);
+      throw std::runtime_error("Failed to connect to serial socket");
+    }
+
+    return std::make_shared<FdSerialBackend>(fd, fd, true);
+  }
+
+  if (spec == "pty") {
+    auto fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+      if (fd >= 0)
+        close(fd);
+      throw std::runtime_error("Failed to create serial pty");
+    }
+
+    // Nobody may be listening on the other end; drop output rather than block the writer forever.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    printf("Serial port is on %s\n", ptsname(fd));
+    return std::make_shared<FdSerialBackend>(fd, fd, true);
+  }
+
+  throw std::runtime_error("Unknown serial backend: " + spec);
+}
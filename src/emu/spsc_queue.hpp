@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+// Fixed-size queue for handing items from exactly one producer thread to exactly one consumer
+// thread without locks. `push` fails rather than blocks when the queue is full.
+template <typename T, size_t Size> class SpscQueue {
+  static_assert((Size & (Size - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  bool push(const T &item) {
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == Size)
+      return false;
+
+    m_items[tail % Size] = item;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &item) {
+    auto head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+
+    item = m_items[head % Size];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops up to `max` items at once; returns how many it got.
+  size_t pop(T *items, size_t max) {
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto count = std::min(max, m_tail.load(std::memory_order_acquire) - head);
+
+    for (size_t i = 0; i < count; i++)
+      items[i] = m_items[(head + i) % Size];
+
+    m_head.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  bool empty() const {
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+  }
+
+private:
+  // Kept on separate cache lines so the two threads don't fight over them.
+  alignas(64) std::atomic<size_t> m_head = 0;
+  alignas(64) std::atomic<size_t> m_tail = 0;
+
+  T m_items[Size];
+};
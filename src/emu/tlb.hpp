@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+enum PageTableEntry : uint32_t {
+  PTE_VALID = 1,
+  PTE_WRITABLE = 2,
+  PTE_KERNEL = 4,
+  PTE_NONCACHED = 8,
+  PTE_GLOBAL = 16,
+};
+
+struct TlbStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+// Set-associative cache of page table entries, tagged with the ASID they were walked under
+// (global pages match any ASID). Each entry keeps the whole PTE, permission bits included, so
+// the caller can reject a write to a read-only or kernel page straight from a hit; the same
+// entry serves reads and writes rather than being cached once per kind of access.
+class Tlb {
+  struct Entry {
+    uint32_t vpn;
+    uint32_t asid;
+    uint32_t pte;
+  };
+
+public:
+  constexpr static uint32_t sets = 64;
+  constexpr static uint32_t ways = 4;
+
+  Tlb() {
+    flush();
+  }
+
+  // Returns the cached PTE, or 0 (which never has `PTE_VALID` set) on a miss.
+  uint32_t lookup(uint32_t vpn, uint32_t asid) {
+    auto &set = m_entries[vpn % sets];
+
+    for (auto &entry : set) {
+      if (entry.pte && entry.vpn == vpn && (entry.asid == asid || entry.pte & PTE_GLOBAL)) {
+        m_stats.hits++;
+        return entry.pte;
+      }
+    }
+
+    m_stats.misses++;
+    return 0;
+  }
+
+  void insert(uint32_t vpn, uint32_t asid, uint32_t pte) {
+    auto set_num = vpn % sets;
+    auto &way = m_next_way[set_num];
+
+    m_entries[set_num][way] = {vpn, asid, pte};
+    way = (way + 1) % ways;
+  }
+
+  // Drops the entry for one page, as the guest sees it under `asid`.
+  void invalidate(uint32_t vpn, uint32_t asid) {
+    for (auto &entry : m_entries[vpn % sets]) {
+      if (entry.pte && entry.vpn == vpn && (entry.asid == asid || entry.pte & PTE_GLOBAL))
+        entry = {};
+    }
+  }
+
+  void flush() {
+    memset(m_entries, 0, sizeof(m_entries));
+    memset(m_next_way, 0, sizeof(m_next_way));
+  }
+
+  const TlbStats &stats() const {
+    return m_stats;
+  }
+
+private:
+  Entry m_entries[sets][ways];
+  uint8_t m_next_way[sets];
+
+  TlbStats m_stats;
+};
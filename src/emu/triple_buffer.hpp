@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free handoff of whole values from one producer thread to one consumer thread. The producer
+// fills `back()` and publishes it; the consumer only ever sees the newest published value, and
+// neither side waits for the other.
+template <typename T> class TripleBuffer {
+  constexpr static uint8_t fresh = 4;
+
+public:
+  T &back() {
+    return m_slots[m_back];
+  }
+
+  // Returns true if the value replaced was never acquired, i.e. the consumer missed it.
+  bool publish() {
+    auto previous = m_ready.exchange(m_back | fresh, std::memory_order_acq_rel);
+
+    m_back = previous & 3;
+    return previous & fresh;
+  }
+
+  // True while the last value published hasn't been acquired. Only the producer should ask: once
+  // this is false it stays false until the next publish.
+  bool pending() const {
+    return m_ready.load(std::memory_order_acquire) & fresh;
+  }
+
+  // The newest published value, or nullptr if nothing was published since the last call.
+  const T *acquire() {
+    if (!(m_ready.load(std::memory_order_relaxed) & fresh))
+      return nullptr;
+
+    m_front = m_ready.exchange(m_front, std::memory_order_acq_rel) & 3;
+    return &m_slots[m_front];
+  }
+
+private:
+  T m_slots[3];
+
+  uint8_t m_back = 0;
+  uint8_t m_front = 1;
+  std::atomic<uint8_t> m_ready = 2;
+};
@@ -1,40 +1,194 @@
-#include <SDL2/SDL.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "emu/amanatsu.hpp"
 #include "emu/bus.hpp"
 #include "emu/cpu.hpp"
+#include "emu/disk_cache.hpp"
+#include "emu/disk_profile.hpp"
 #include "emu/kinnowfb.hpp"
 #include "emu/lsic.hpp"
 #include "emu/platform.hpp"
 #include "emu/ram.hpp"
 #include "emu/rtc.hpp"
+#include "emu/scheduler.hpp"
 #include "emu/serial.hpp"
 
-constexpr static auto instructions_per_sec = 25'000'000;
+#ifndef LS_EMU_HEADLESS
+#include "display.hpp"
+#endif
+
 constexpr static auto ticks_per_second = 60;
 
-int main() {
-  if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-    printf("Unable to initialize SDL: %s", SDL_GetError());
-    return 1;
+constexpr static const char *disk_images[] = {"mintia-dist.img", "aisix-dist.img"};
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static int usage(const char *program) {
+  printf("Usage: %s [options]\n", program);
+  printf("  --jit                 Translate hot blocks to host code\n");
+  printf("  --no-threaded         Use the stepping interpreter\n");
+  printf("  --virtual-time        Run as fast as possible, with guest clocks following guest time\n");
+  printf("  --headless            Run without a window (implies --virtual-time)\n");
+  printf("  --native-pixels       Upload the framebuffer to the display as it is\n");
+  printf("  --ips N               Instructions per second of guest time\n");
+  printf("  --epoch SECONDS       Start the guest clock at this time\n");
+  printf("  --disk-mmap           Access disk images through memory mappings\n");
+  printf("  --disk-sparse         Keep disk images sparse, freeing zeroed and discarded blocks\n");
+  printf("  --disk-sync POLICY    When disk writes reach storage: never, close (default) or write\n");
+  printf("  --disk-cache MIB      Cache this much of each disk in memory, reading ahead of sequential reads\n");
+  printf("  --disk-profile DIR    Record the blocks each run reads in DIR and prefetch them at the next start\n");
+  printf("  --overlay DIR         Keep disk changes in copy-on-write overlays in DIR, leaving the images alone\n");
+  printf("  --discard-overlays    Start over with empty overlays\n");
+  printf("  --commit-overlays     Write the overlays' changes into the images, then exit\n");
+  printf("  --serial0 BACKEND     Where serial port 0 goes: stdout (default), stdio, file:PATH, unix:PATH or pty\n");
+  printf("  --serial1 BACKEND     Same for serial port 1\n");
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  // The guest console goes straight to fd 1 from the serial writer; the emulator's own messages
+  // mustn't sit in a buffer and show up out of order with it, or not at all.
+  setbuf(stdout, nullptr);
+
+  auto use_jit = false;
+  auto use_threaded = true;
+  auto virtual_time = false;
+  auto headless = false;
+  auto native_pixels = false;
+  std::string serial_specs[2] = {"stdout", "stdout"};
+  DiskOptions disk_options;
+  size_t disk_cache_mib = 0;
+  std::filesystem::path profile_dir;
+  std::filesystem::path overlay_dir;
+  auto discard_overlays = false;
+  auto commit_overlays = false;
+  uint64_t instructions_per_sec = 25'000'000;
+  auto epoch_ms = Rtc::host_time_ms();
+  auto fixed_epoch = false;
+
+  for (auto i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--jit")) {
+      use_jit = true;
+    } else if (!strcmp(argv[i], "--no-threaded")) {
+      use_threaded = false;
+    } else if (!strcmp(argv[i], "--virtual-time")) {
+      virtual_time = true;
+    } else if (!strcmp(argv[i], "--headless")) {
+      headless = true;
+    } else if (!strcmp(argv[i], "--native-pixels")) {
+      native_pixels = true;
+    } else if (!strcmp(argv[i], "--ips") && i + 1 < argc) {
+      instructions_per_sec = std::max(strtoull(argv[++i], nullptr, 0), 1000ull);
+    } else if (!strcmp(argv[i], "--epoch") && i + 1 < argc) {
+      epoch_ms = strtoull(argv[++i], nullptr, 0) * 1000;
+      fixed_epoch = true;
+    } else if (!strcmp(argv[i], "--disk-mmap")) {
+      disk_options.backend = DISK_BACKEND_MMAP;
+    } else if (!strcmp(argv[i], "--disk-sparse")) {
+      disk_options.backend = DISK_BACKEND_SPARSE;
+    } else if (!strcmp(argv[i], "--disk-sync") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "never"))
+        disk_options.sync = DISK_SYNC_NEVER;
+      else if (!strcmp(argv[i], "close"))
+        disk_options.sync = DISK_SYNC_ON_CLOSE;
+      else if (!strcmp(argv[i], "write"))
+        disk_options.sync = DISK_SYNC_EVERY_WRITE;
+      else
+        return usage(argv[0]);
+    } else if (!strcmp(argv[i], "--disk-cache") && i + 1 < argc) {
+      disk_cache_mib = strtoull(argv[++i], nullptr, 0);
+    } else if (!strcmp(argv[i], "--disk-profile") && i + 1 < argc) {
+      profile_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--overlay") && i + 1 < argc) {
+      overlay_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--discard-overlays")) {
+      discard_overlays = true;
+    } else if (!strcmp(argv[i], "--commit-overlays")) {
+      commit_overlays = true;
+    } else if (!strcmp(argv[i], "--serial0") && i + 1 < argc) {
+      serial_specs[0] = argv[++i];
+    } else if (!strcmp(argv[i], "--serial1") && i + 1 < argc) {
+      serial_specs[1] = argv[++i];
+    } else {
+      return usage(argv[0]);
+    }
   }
 
-  SDL_Window *window = SDL_CreateWindow("ls-emu", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1024, 768, 0);
-  if (!window) {
-    printf("Failed to create window: %s\n", SDL_GetError());
-    return 1;
+  if ((commit_overlays || discard_overlays) && overlay_dir.empty())
+    return usage(argv[0]);
+
+  auto overlay_path = [&](const char *image) { return overlay_dir / (std::string(image) + ".overlay"); };
+  auto profile_path = [&](const char *image) { return profile_dir / (std::string(image) + ".profile"); };
+
+  if (commit_overlays) {
+    try {
+      for (auto image : disk_images) {
+        if (!std::filesystem::exists(overlay_path(image)))
+          continue;
+
+        if (CompressedDiskImage::is_compressed(image)) {
+          printf("%s: compressed images can't be committed into\n", image);
+          continue;
+        }
+
+        auto overlay = open_overlay_image(image, overlay_path(image), disk_options);
+        auto base = open_disk_image(image, disk_options);
+
+        printf("%s: committed %u blocks\n", image, overlay->commit(*base));
+      }
+    } catch (const std::runtime_error &e) {
+      printf("%s\n", e.what());
+      return 1;
+    }
+
+    return 0;
   }
 
-  SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
-  if (!renderer) {
-    printf("Could not create renderer: %s", SDL_GetError());
+  std::shared_ptr<SerialBackend> serial_backends[2];
+
+  try {
+    serial_backends[0] = open_serial_backend(serial_specs[0]);
+
+    // Both ports default to stdout; sharing one writer keeps their lines from interleaving. Ports
+    // with input can't share, or they'd steal each other's.
+    if (serial_specs[1] == serial_specs[0] && !serial_backends[0]->has_input())
+      serial_backends[1] = serial_backends[0];
+    else
+      serial_backends[1] = open_serial_backend(serial_specs[1]);
+  } catch (const std::runtime_error &e) {
+    printf("%s\n", e.what());
     return 1;
   }
 
-  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 1024, 768);
-  if (!texture) {
-    printf("Could not create texture: %s", SDL_GetError());
-    return 1;
+#ifdef LS_EMU_HEADLESS
+  headless = true;
+#else
+  std::unique_ptr<Display> display;
+
+  if (!headless) {
+    try {
+      display = std::make_unique<Display>(1024, 768, native_pixels);
+    } catch (const std::runtime_error &e) {
+      printf("%s\n", e.what());
+      return 1;
+    }
+  }
+#endif
+
+  // Nobody is watching a headless run, so it goes as fast as it can; Ctrl-C still exits cleanly.
+  if (headless) {
+    virtual_time = true;
+    std::signal(SIGINT, [](int) { interrupted = 1; });
   }
 
   Bus bus;
@@ -43,83 +197,173 @@ int main() {
   KinnowFb kinnow(bus, 1024, 768);
 
   InterruptController lsic;
-  DiskController disk_ctl;
+
+  Cpu cpu(bus, lsic);
+  Scheduler scheduler(cpu, instructions_per_sec);
+
+  DiskController disk_ctl(bus, lsic, scheduler);
 
   // ?????
   auto _ = std::shared_ptr<DiskController>(&disk_ctl, [](auto) {});
 
-  disk_ctl.attach("mintia-dist.img");
-  disk_ctl.attach("aisix-dist.img");
+  if (!overlay_dir.empty())
+    std::filesystem::create_directories(overlay_dir);
+  if (!profile_dir.empty())
+    std::filesystem::create_directories(profile_dir);
+
+  std::vector<CachedDiskImage *> disk_caches;
+
+  for (auto image : disk_images) {
+    std::unique_ptr<DiskImage> disk;
+
+    if (overlay_dir.empty()) {
+      disk = open_disk_image(image, disk_options);
+    } else {
+      if (discard_overlays)
+        std::filesystem::remove(overlay_path(image));
+
+      disk = open_overlay_image(image, overlay_path(image), disk_options);
+    }
+
+    // Profiles are warmed into the cache, so they need one even if none was asked for.
+    if (disk_cache_mib || !profile_dir.empty()) {
+      auto cached = std::make_unique<CachedDiskImage>(std::move(disk), disk_cache_mib);
+
+      if (!profile_dir.empty()) {
+        cached->warm(load_disk_profile(profile_path(image), cached->block_count()));
+        cached->record_profile();
+      }
+
+      disk_caches.push_back(cached.get());
+      disk = std::move(cached);
+    }
+
+    disk_ctl.attach(std::move(disk));
+  }
+
+  auto print_stats = [&] {
+    for (auto [name, stats] : {std::pair{"ITLB", cpu.itlb_stats()}, std::pair{"DTLB", cpu.dtlb_stats()}}) {
+      auto lookups = stats.hits + stats.misses;
+      fprintf(stderr, "%s: %llu hits, %llu misses (%.2f%% hit rate)\n", name, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+              lookups ? 100.0 * stats.hits / lookups : 0.0);
+    }
+
+    for (size_t i = 0; i < disk_caches.size(); i++) {
+      auto stats = disk_caches[i]->stats();
+      auto accuracy = stats.prefetched ? 100.0 * stats.prefetch_hits / stats.prefetched : 0.0;
+
+      fprintf(stderr, "%s cache: %llu hits, %llu misses, %llu prefetched (%llu from the profile, %.1f%% used)\n", disk_images[i],
+              (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.prefetched,
+              (unsigned long long)stats.warmed, accuracy);
+    }
+  };
+
+  // The profile is whatever this run read, so the next boot follows the latest one.
+  auto save_disk_profiles = [&] {
+    if (profile_dir.empty())
+      return;
+
+    for (size_t i = 0; i < disk_caches.size(); i++) {
+      if (!save_disk_profile(profile_path(disk_images[i]), disk_caches[i]->block_count(), disk_caches[i]->profile()))
+        fprintf(stderr, "%s: failed to save the boot profile\n", disk_images[i]);
+    }
+  };
+
+  cpu.set_threaded(use_threaded);
 
   Platform board(bus, lsic, disk_ctl, "boot.bin");
-  SerialPort serial1(board, 0);
-  SerialPort serial2(board, 1);
-  Rtc rtc(board);
+  SerialPort serial1(board, lsic, scheduler, 0, *serial_backends[0]);
+  SerialPort serial2(board, lsic, scheduler, 1, *serial_backends[1]);
+  Rtc rtc(board, lsic, scheduler);
+
+  // On virtual time the guest's clock follows guest time too, so it doesn't drift with host speed.
+  if (virtual_time || fixed_epoch)
+    rtc.set_epoch(epoch_ms);
 
   Amanatsu amanatsu(board);
   AmanatsuKeyboard keyboard(amanatsu);
   AmanatsuMouse mouse(amanatsu);
 
-  Cpu cpu(bus, lsic);
+  if (use_jit && !cpu.enable_jit())
+    printf("JIT is not supported on this host, falling back to the interpreter\n");
+
+  std::atomic<bool> done = false;
 
-  SDL_ShowWindow(window);
-  SDL_RenderClear(renderer);
-  SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+#ifndef LS_EMU_HEADLESS
+  KeyQueue keys;
+  FrameHandoff frames;
+#endif
 
-  auto done = false;
-  auto tick_start = SDL_GetTicks();
-  auto tick_end = SDL_GetTicks();
-  auto ticks = 0;
+  auto emulate = [&] {
+    while (!done && !interrupted) {
+      auto frame_start = std::chrono::steady_clock::now();
+
+#ifndef LS_EMU_HEADLESS
+      KeyEvent key;
+      while (keys.pop(key)) {
+        keyboard.handle_key(key.code, key.pressed);
+        if (keyboard.interrupt_line)
+          lsic.raise(keyboard.interrupt_line);
+      }
+#endif
 
-  while (!done) {
-    auto ms = std::max(SDL_GetTicks() - tick_start, 1);
-    auto instr_to_run = instructions_per_sec / ticks_per_second / ms;
+      // Every frame covers the same guest time; the CPU only stops early for device events.
+      auto frame_end = scheduler.now() + scheduler.from_ms(1000 / ticks_per_second);
 
-    tick_start = SDL_GetTicks();
+      while (scheduler.now() < frame_end) {
+        auto result = cpu.run(frame_end - scheduler.now());
 
-    for (auto i = 0; i < ms; i++) {
-      for (auto j = 0; j < instr_to_run; j++) {
-        cpu.execute();
+        // Nothing but a device event or the next frame's input can wake a halted CPU, so skip the idle time.
+        if (result.reason == STOP_HALTED)
+          scheduler.skip_to(std::min(scheduler.next_event(), frame_end));
 
-        if (cpu.is_halted())
-          break;
+        scheduler.run_due();
       }
 
-      rtc.tick(lsic, 1);
-    }
+#ifndef LS_EMU_HEADLESS
+      if (display)
+        frames.publish(kinnow);
+#endif
 
-    SDL_Event event;
+      if (virtual_time)
+        continue;
 
-    while (SDL_PollEvent(&event)) {
-      switch (event.type) {
-      case SDL_QUIT: // Handle native app exit
-        done = true;
-        break;
-      case SDL_KEYDOWN:
-      case SDL_KEYUP:
-        keyboard.handle_key_event(event.key);
-        if (keyboard.interrupt_line)
-          lsic.raise(keyboard.interrupt_line);
-        break;
-      }
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - frame_start);
+      auto time_left = 1000 / ticks_per_second - (int)elapsed.count();
+
+      if (time_left > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(time_left));
+      else if (time_left < 0)
+        printf("Time overrun: %dms\n", -time_left);
     }
+  };
 
-    if (ticks % ticks_per_second == 0) {
-      kinnow.draw(texture);
+#ifndef LS_EMU_HEADLESS
+  // The emulator gets a thread of its own so presenting never holds it up, while SDL stays on the
+  // main thread where it wants to be.
+  if (display) {
+    std::thread emulator(emulate);
 
-      SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-      SDL_RenderPresent(renderer);
-    }
+    while (!done) {
+      auto frame_start = std::chrono::steady_clock::now();
+
+      if (!display->poll_events(keys))
+        done = true;
 
-    tick_end = SDL_GetTicks();
+      display->present(frames.acquire());
 
-    auto time_left = 1000 / ticks_per_second - (int)(tick_end - tick_start);
+      std::this_thread::sleep_until(frame_start + std::chrono::milliseconds(1000 / ticks_per_second));
+    }
 
-    if (time_left > 0)
-      SDL_Delay(time_left);
-    else if (time_left < 0)
-      printf("Time overrun: %dms\n", -time_left);
+    emulator.join();
+    print_stats();
+    save_disk_profiles();
+    return 0;
   }
+#endif
 
+  emulate();
+  print_stats();
+  save_disk_profiles();
   return 0;
 }
@@ -0,0 +1,56 @@
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../emu/kinnow_convert.hpp"
+#include "../emu/kinnow_palette.hpp"
+
+// Runs every conversion kernel the host supports over all 32768 colours (and again with the
+// ignored top bit set), from misaligned source and destination offsets and with every tail
+// length, and compares each pixel against the original palette table.
+static int check(const char *name, KinnowConvert convert) {
+  std::vector<uint16_t> src(65536 + 64);
+  std::vector<uint32_t> dst(65536 + 64);
+  int mismatches = 0;
+
+  for (int src_offset = 0; src_offset < 16; src_offset++) {
+    for (int dst_offset = 0; dst_offset < 16; dst_offset += 3) {
+      for (int tail = 0; tail < 17; tail++) {
+        auto count = 65536 - 16 + tail;
+
+        for (int i = 0; i < count; i++)
+          src[src_offset + i] = i;
+
+        std::fill(dst.begin(), dst.end(), 0xdeadbeef);
+        convert(dst.data() + dst_offset, src.data() + src_offset, count);
+
+        for (int i = 0; i < count; i++) {
+          if (dst[dst_offset + i] != kinnow_palette[i & 0x7fff] && mismatches++ < 10)
+            printf("%s: %04x -> %08x, expected %08x\n", name, i, dst[dst_offset + i], kinnow_palette[i & 0x7fff]);
+        }
+
+        // Nothing past the end gets written.
+        if (dst[dst_offset + count] != 0xdeadbeef && mismatches++ < 10)
+          printf("%s: wrote past %d pixels\n", name, count);
+      }
+    }
+  }
+
+  printf("%s: %s\n", name, mismatches ? "FAILED" : "ok");
+  return mismatches;
+}
+
+int main() {
+  auto failed = check("scalar", kinnow_convert_scalar) != 0;
+
+#ifdef LS_EMU_HAS_SIMD_CONVERT
+  failed |= check("sse2", kinnow_convert_sse2) != 0;
+
+  if (__builtin_cpu_supports("avx2"))
+    failed |= check("avx2", kinnow_convert_avx2) != 0;
+  else
+    printf("avx2: not supported on this host, skipped\n");
+#endif
+
+  return failed ? 1 : 0;
+}
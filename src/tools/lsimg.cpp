@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../emu/disk_image.hpp"
+
+static int usage(const char *program) {
+  printf("Usage: %s compress IMAGE OUTPUT [CHUNK_KIB]\n", program);
+  printf("       %s decompress IMAGE OUTPUT\n", program);
+  return 1;
+}
+
+static void compress(const char *input, const char *output, uint32_t chunk_size) {
+  auto image = open_disk_image(input, {.read_only = true});
+  CompressedDiskImage::create(*image, output, chunk_size);
+
+  auto input_size = (double)image->block_count() * DiskImage::block_size;
+  auto output_size = (double)std::filesystem::file_size(output);
+
+  printf("%s: %.1f MiB -> %.1f MiB (%.1f%%)\n", output, input_size / (1024 * 1024), output_size / (1024 * 1024),
+         input_size ? 100.0 * output_size / input_size : 0.0);
+}
+
+// Zero blocks are left as holes, so the plain image comes out sparse.
+static void decompress(const char *input, const char *output) {
+  CompressedDiskImage image(input);
+
+  auto fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Failed to create output image");
+
+  uint8_t block[DiskImage::block_size];
+  auto ok = ftruncate(fd, (off_t)image.block_count() * DiskImage::block_size) == 0;
+
+  for (uint32_t i = 0; i < image.block_count() && ok; i++) {
+    image.read_block(i, block);
+
+    if (std::any_of(block, block + sizeof(block), [](auto byte) { return byte != 0; }))
+      ok = pwrite(fd, block, sizeof(block), (off_t)i * DiskImage::block_size) == sizeof(block);
+  }
+
+  close(fd);
+
+  if (!ok)
+    throw std::runtime_error("Failed to write output image");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4)
+    return usage(argv[0]);
+
+  try {
+    if (!strcmp(argv[1], "compress") && argc <= 5) {
+      auto chunk_kib = argc == 5 ? strtoul(argv[4], nullptr, 0) : CompressedDiskImage::default_chunk_size / 1024;
+      compress(argv[2], argv[3], chunk_kib * 1024);
+    } else if (!strcmp(argv[1], "decompress") && argc == 4) {
+      decompress(argv[2], argv[3]);
+    } else {
+      return usage(argv[0]);
+    }
+  } catch (const std::runtime_error &e) {
+    printf("%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}